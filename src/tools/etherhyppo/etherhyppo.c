@@ -1,16 +1,16 @@
 
 /* Sample UDP client */
 
-#include <arpa/inet.h>
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
 #include <fcntl.h>
 
+#include "ethertransfer.h"
+
 unsigned char all_done_routine[128] = {
   0xa9, 0x00,       // LDA #$00 so that hyppo recognises packet
   0x8d, 0x54, 0xd0, // Clear 16-bit character mode etc, just to be sure
@@ -27,45 +27,183 @@ unsigned char hyppo_replace_routine[128] = { 0xa9, 0x00, 0x5b, 0xa9, 0x00, 0x85,
   0x85, 0x87, 0xa3, 0x00, 0xea, 0xb2, 0x80, 0xea, 0x92, 0x84, 0x1b, 0xd0, 0xf7, 0xe6, 0x81, 0xe6, 0x85, 0xa5, 0x81, 0xc9,
   0x80, 0xd0, 0xed, 0x4c, 0x00, 0x81 };
 
-unsigned char dma_load_routine[128 + 1024] = {
-  // Routine that copies packet contents by DMA
-  0xa9, 0xff, 0x8d, 0x05, 0xd7, 0xad, 0x68, 0x68, 0x8d, 0x06, 0xd7, 0xa9, 0x0d, 0x8d, 0x02, 0xd7, 0xa9, 0xe8, 0x8d, 0x01,
-  0xd7, 0xa9, 0xff, 0x8d, 0x04, 0xd7, 0xa9, 0x5c, 0x8d, 0x00, 0xd7, 0xae, 0x67, 0x68, 0xea, 0x9d, 0x80, 0x06, 0xee, 0x26,
-  0x04, 0xd0, 0x03, 0xee, 0x25, 0x04, 0x60, 0x00,
-
-  // DMA list begins at offset $0030
-  0x00, // DMA command ($0030)
-#define BYTE_COUNT_OFFSET 0x31
-  0x00, 0x04,       // DMA byte count ($0031-$0032)
-  0x80, 0xe8, 0x8d, // DMA source address (points to data in packet)
-#define DESTINATION_ADDRESS_OFFSET 0x36
-  0x00, 0x10, // DMA Destination address (bottom 16 bits)
-#define DESTINATION_BANK_OFFSET 0x38
-  0x00,       // DMA Destination bank
-  0x00, 0x00, // DMA modulo (ignored)
-// Packet ID number at offset $003B
-#define PACKET_NUMBER_OFFSET 0x3b
-  0x30,
-#define DESTINATION_MB_OFFSET 0x3c
-  // Destination MB at $003C
-  0x00, 0x00, 0x00, 0x00
-#define DATA_OFFSET (0x80 - 0x2c)
-};
-
 // Test routine to increment border colour
 unsigned char test_routine[64] = { 0xa9, 0x00, 0xee, 0x21, 0xd0, 0x60 };
 
+/* ---- Delta pushes ----
+
+  Hyppo can't tell us what is in memory, so we remember the hash of every 1KB block that we have
+  pushed to each MEGA65, in ~/.etherhyppo-<IP address>, and then only send the blocks whose hash
+  has changed.  That is only right if nothing else has changed those blocks since, so it has to
+  be asked for, and -f starts again from scratch, e.g., after the MEGA65 has been power cycled.
+  Programmes change their own memory once they are started, and hyppo's is ordinary RAM once it
+  has been replaced, so only push can use -d, and anything else that is loaded forgets the hashes
+  of the blocks that it loads over.
+*/
+
+#define BLOCK_SIZE 1024
+
+struct block_hash {
+  unsigned int address;
+  unsigned long long hash;
+};
+
+struct block_hash *block_hashes = NULL;
+int block_hash_count = 0;
+char hash_file[1024];
+
+int compare_block_hashes(const void *a, const void *b)
+{
+  unsigned int a_address = ((struct block_hash *)a)->address;
+  unsigned int b_address = ((struct block_hash *)b)->address;
+  return a_address < b_address ? -1 : a_address > b_address;
+}
+
+unsigned long long block_hash(unsigned int address, unsigned char *data, int len)
+{
+  // FNV-1a, including where the bytes are in the block, as blocks at
+  // either end of a push need not be full
+  unsigned long long hash = 0xcbf29ce484222325ULL ^ (address & (BLOCK_SIZE - 1)) ^ ((unsigned long long)len << 16);
+  for (int i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void add_block_hash(unsigned int address, unsigned long long hash)
+{
+  if (!(block_hash_count & 0x3ff)) {
+    block_hashes = realloc(block_hashes, (block_hash_count + 0x400) * sizeof(struct block_hash));
+    if (!block_hashes) {
+      perror("realloc()");
+      exit(-1);
+    }
+  }
+  block_hashes[block_hash_count].address = address;
+  block_hashes[block_hash_count].hash = hash;
+  block_hash_count++;
+}
+
+void load_block_hashes(char *ip_address)
+{
+  char *home = getenv("HOME");
+  snprintf(hash_file, sizeof(hash_file), "%s/.etherhyppo-%s", home ? home : ".", ip_address);
+  FILE *f = fopen(hash_file, "r");
+  if (!f)
+    return;
+  unsigned int address;
+  unsigned long long hash;
+  while (fscanf(f, "%x %llx", &address, &hash) == 2)
+    add_block_hash(address, hash);
+  fclose(f);
+  qsort(block_hashes, block_hash_count, sizeof(struct block_hash), compare_block_hashes);
+}
+
+void save_block_hashes(void)
+{
+  char temp_file[1100];
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", hash_file);
+  FILE *f = fopen(temp_file, "w");
+  if (!f) {
+    fprintf(stderr, "WARNING: Could not write %s, so the next push will be in full.\n", temp_file);
+    return;
+  }
+  for (int i = 0; i < block_hash_count; i++)
+    fprintf(f, "%07x %016llx\n", block_hashes[i].address, block_hashes[i].hash);
+  fclose(f);
+  rename(temp_file, hash_file);
+}
+
+// Forgets the blocks that a load that is not a delta push will change
+void forget_block_hashes(unsigned int address, int len)
+{
+  int kept = 0;
+  unsigned int first = address & ~(BLOCK_SIZE - 1);
+  for (int i = 0; i < block_hash_count; i++)
+    if (block_hashes[i].address < first || block_hashes[i].address >= address + len)
+      block_hashes[kept++] = block_hashes[i];
+  if (kept == block_hash_count)
+    return;
+  block_hash_count = kept;
+  save_block_hashes();
+}
+
+// Returns 1 if the block has changed, and remembers its new hash.  Only the
+// first sorted entries are searched, as new blocks are added to the end,
+// and sorted in with the rest once the push has been queued.
+int block_changed(unsigned int address, unsigned char *data, int len, int sorted)
+{
+  struct block_hash key = { address & ~(BLOCK_SIZE - 1), block_hash(address, data, len) };
+  struct block_hash *b = bsearch(&key, block_hashes, sorted, sizeof(struct block_hash), compare_block_hashes);
+  if (!b) {
+    add_block_hash(key.address, key.hash);
+    return 1;
+  }
+  if (b->hash == key.hash)
+    return 0;
+  b->hash = key.hash;
+  return 1;
+}
+
+// Queues only the blocks that have changed since the last push, with runs of
+// changed blocks queued together, so that they can be compressed together.
+void queue_delta_load(unsigned int address, unsigned char *data, int len)
+{
+  int sorted = block_hash_count;
+  int changed = 0;
+  int blocks = 0;
+  int run_start = -1;
+
+  for (int offset = 0; offset < len; blocks++) {
+    int bytes = BLOCK_SIZE - ((address + offset) & (BLOCK_SIZE - 1));
+    if (bytes > len - offset)
+      bytes = len - offset;
+    if (block_changed(address + offset, &data[offset], bytes, sorted)) {
+      changed++;
+      if (run_start < 0)
+        run_start = offset;
+    }
+    else if (run_start >= 0) {
+      ether_queue_load(address + run_start, &data[run_start], offset - run_start);
+      run_start = -1;
+    }
+    offset += bytes;
+  }
+  if (run_start >= 0)
+    ether_queue_load(address + run_start, &data[run_start], len - run_start);
+  qsort(block_hashes, block_hash_count, sizeof(struct block_hash), compare_block_hashes);
+  printf("%d of %d blocks have changed since the last push.\n", changed, blocks);
+}
+
 int usage()
 {
-  printf("usage:  etherhyppo <run|hickup> <IP address> <programme>\n");
-  printf("        etherhyppo push <IP address> <file> <28-bit address (hex)>\n");
+  printf("usage:  etherhyppo [-z] <run|hickup> <IP address> <programme>\n");
+  printf("        etherhyppo [-z] [-d [-f]] push <IP address> <file> <28-bit address (hex)>\n");
+  printf("  -z  compress runs of the same byte into DMA fills\n");
+  printf("  -d  only send the 1KB blocks that have changed since the last push to this IP address.\n");
+  printf("      Hyppo does not acknowledge packets, so each one is sent twice, but a block that was\n");
+  printf("      lost both times will not be sent again by later pushes until it changes, or -f is used.\n");
+  printf("  -f  forget what was pushed before, and send everything\n");
   exit(1);
 }
 
 int main(int argc, char **argv)
 {
-  int sockfd;
-  struct sockaddr_in servaddr;
+  int delta = 0;
+  int forget = 0;
+  while (argc > 1 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-z"))
+      ether_compress = 1;
+    else if (!strcmp(argv[1], "-d"))
+      delta = 1;
+    else if (!strcmp(argv[1], "-f"))
+      forget = 1;
+    else
+      usage();
+    argc--;
+    argv++;
+  }
 
   if (argc < 4) {
     printf("Too few arguments.\n");
@@ -90,15 +228,15 @@ int main(int argc, char **argv)
   else {
     usage();
   }
+  if (delta && runmode != 2) {
+    printf("-d can only be used with push, as programmes change their own memory once started.\n");
+    usage();
+  }
 
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  int broadcastEnable = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &broadcastEnable, sizeof(broadcastEnable));
-
-  bzero(&servaddr, sizeof(servaddr));
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = inet_addr(argv[2]);
-  servaddr.sin_port = htons(4511);
+  // Hyppo does not acknowledge packets, so they are just sent a little
+  // apart, and routines sent several times.
+  if (ether_open(argv[2], ETHERHYPPO_PORT, 0))
+    exit(-1);
 
   int fd = open(argv[3], O_RDWR);
 
@@ -108,7 +246,6 @@ int main(int argc, char **argv)
   }
 
   unsigned char buffer[1024];
-  int offset = 0;
   int bytes;
 
   if (runmode == 1) {
@@ -129,42 +266,51 @@ int main(int argc, char **argv)
     printf("Load address is $%07x\n", address);
   }
 
-  while ((bytes = read(fd, buffer, 1024)) != 0) {
-    printf("Read %d bytes at offset %d\n", bytes, offset);
-    offset += bytes;
-
-    // Set load address of packet
-    dma_load_routine[DESTINATION_ADDRESS_OFFSET] = address & 0xff;
-    dma_load_routine[DESTINATION_ADDRESS_OFFSET + 1] = (address >> 8) & 0xff;
-    dma_load_routine[DESTINATION_BANK_OFFSET] = (address >> 16) & 0x0f;
-    dma_load_routine[DESTINATION_MB_OFFSET] = (address >> 20) & 0xff;
-
-    // Copy data into packet
-    bcopy(buffer, &dma_load_routine[DATA_OFFSET], bytes);
-
-    sendto(sockfd, dma_load_routine, sizeof dma_load_routine, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
-    usleep(150);
+  // Read the whole file, so that compression can see runs that span blocks
+  unsigned char *data = NULL;
+  int len = 0;
+  do {
+    data = realloc(data, len + 65536);
+    if (!data) {
+      perror("realloc()");
+      exit(-1);
+    }
+    bytes = read(fd, &data[len], 65536);
+    if (bytes > 0)
+      len += bytes;
+  } while (bytes > 0);
+  close(fd);
 
-    dma_load_routine[PACKET_NUMBER_OFFSET]++;
-    address += bytes;
+  if (delta) {
+    load_block_hashes(argv[2]);
+    if (forget)
+      block_hash_count = 0;
+    queue_delta_load(address, data, len);
+    // The blocks will be taken to have been pushed, so make that more likely
+    ether_load_passes = 2;
   }
+  else
+    ether_queue_load(address, data, len);
+  if (ether_send())
+    exit(-1);
+  if (delta)
+    save_block_hashes();
+  else {
+    load_block_hashes(argv[2]);
+    forget_block_hashes(address, len);
+  }
+  ether_report(argv[3]);
 
   if (runmode == 1) {
     // Tell C65GS that we are all done
-    int i;
     printf("Trying to start program ...\n");
-    for (i = 0; i < 10; i++) {
-      sendto(sockfd, all_done_routine, sizeof all_done_routine, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
-      usleep(150);
-    }
+    ether_queue_routine(all_done_routine, sizeof all_done_routine, 10);
+    ether_send();
   }
   else if (runmode == 0) {
-    int i;
     printf("Telling hyppo to upgrade ...\n");
-    for (i = 0; i < 10; i++) {
-      sendto(sockfd, hyppo_replace_routine, sizeof hyppo_replace_routine, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
-      usleep(150);
-    }
+    ether_queue_routine(hyppo_replace_routine, sizeof hyppo_replace_routine, 10);
+    ether_send();
   }
   else {
     printf("Push mode -- leaving C65GS in etherhyppo.\n");
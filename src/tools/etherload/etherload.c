@@ -1,14 +1,7 @@
 
 /* Sample UDP client */
 
-#ifdef _WIN32
-#include <winsock2.h>
-#else
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#endif
-
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -16,9 +9,9 @@
 #include <stdio.h>
 #include <fcntl.h>
 
-#define PORTNUM 4510
+#include "ethertransfer.h"
 
-char all_done_routine[128] = {
+unsigned char all_done_routine[128] = {
   // Dummy inc $d020 jmp *-3 routine for debugging
   0xa9, 0x00, 0xee, 0x20, 0xd0, 0x4c, 0x2c, 0x68,
 
@@ -30,60 +23,56 @@ char all_done_routine[128] = {
   0xa0, 0x00, 0xa3, 0x00, 0x5c, 0xea, 0x68, 0x68, 0x60
 };
 
-char dma_load_routine[128 + 1024] = {
-  // Routine that copies packet contents by DMA
-  0xa9, 0xff, 0x8d, 0x05, 0xd7, 0xad, 0x68, 0x68, 0x8d, 0x06, 0xd7, 0xa9, 0x0d, 0x8d, 0x02, 0xd7, 0xa9, 0xe8, 0x8d, 0x01,
-  0xd7, 0xa9, 0xff, 0x8d, 0x04, 0xd7, 0xa9, 0x5c, 0x8d, 0x00, 0xd7, 0xae, 0x67, 0x68, 0xea, 0x9d, 0x80, 0x06, 0xee, 0x26,
-  0x04, 0xd0, 0x03, 0xee, 0x25, 0x04, 0x60, 0x00,
-
-  // DMA list begins at offset $0030
-  0x00, // DMA command ($0030)
-#define BYTE_COUNT_OFFSET 0x31
-  0x00, 0x04,       // DMA byte count ($0031-$0032)
-  0x80, 0xe8, 0x8d, // DMA source address (points to data in packet)
-#define DESTINATION_ADDRESS_OFFSET 0x36
-  0x00, 0x10, // DMA Destination address (bottom 16 bits)
-#define DESTINATION_BANK_OFFSET 0x38
-  0x00,       // DMA Destination bank
-  0x00, 0x00, // DMA modulo (ignored)
-// Packet ID number at offset $003B
-#define PACKET_NUMBER_OFFSET 0x3b
-  0x30,
-#define DESTINATION_MB_OFFSET 0x3c
-  // Destination MB at $003C
-  0x00, 0x00, 0x00, 0x00
-#define DATA_OFFSET (0x80 - 0x2c)
-};
-
 // Test routine to increment border colour
-char test_routine[64] = { 0xa9, 0x00, 0xee, 0x21, 0xd0, 0x60 };
+unsigned char test_routine[64] = { 0xa9, 0x00, 0xee, 0x21, 0xd0, 0x60 };
 
-int main(int argc, char **argv)
+void usage(char *name)
 {
-  int sockfd;
-  struct sockaddr_in servaddr;
+  printf("usage: %s [-n boards | -u] [-i interface address] <IP address> <programme>\n", name);
+  printf("  -n  number of MEGA65s that must load the programme, when sending to a broadcast or\n"
+         "      multicast address\n");
+  printf("  -u  do not wait for acknowledgements, but send packets a little apart, for MEGA65s running\n"
+         "      an older etherload that does not acknowledge them.  Lost packets are not noticed.\n");
+  printf("  -i  send from the interface with this address\n");
+  exit(1);
+}
 
-  if (argc != 3) {
-    printf("usage: %s <IP address> <programme>\n", argv[0]);
-    exit(1);
+int main(int argc, char **argv)
+{
+  int acknowledged = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:u")) != -1) {
+    switch (opt) {
+    case 'i':
+      ether_interface = optarg;
+      break;
+    case 'n':
+      ether_boards = atoi(optarg);
+      if (ether_boards < 1 || ether_boards > MAX_BOARDS) {
+        fprintf(stderr, "Can only load 1 to %d MEGA65s at once.\n", MAX_BOARDS);
+        exit(1);
+      }
+      break;
+    case 'u':
+      acknowledged = 0;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if (argc - optind != 2 || (!acknowledged && ether_boards > 1))
+    usage(argv[0]);
+  argv += optind - 1;
 
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  int broadcastEnable = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, (char *)&broadcastEnable, sizeof(broadcastEnable));
-
-  memset(&servaddr, 0, sizeof(servaddr));
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_addr.s_addr = inet_addr(argv[1]);
-  servaddr.sin_port = htons(PORTNUM);
-
-  // print out debug info
-  printf("Using dst-addr: %s\n", inet_ntoa(servaddr.sin_addr));
-  printf("Using src-port: %d\n", ntohs(servaddr.sin_port));
+  if (ether_open(argv[1], ETHERLOAD_PORT, acknowledged))
+    exit(-1);
 
-  int fd = open(argv[2], O_RDWR);
+  int fd = open(argv[2], O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file '%s'\n", argv[2]);
+    exit(-1);
+  }
   unsigned char buffer[1024];
-  int offset = 0;
   int bytes;
 
   // Read 2 byte load address
@@ -96,44 +85,19 @@ int main(int argc, char **argv)
   int address = buffer[0] + 256 * buffer[1];
   printf("Load address of programme is $%04x\n", address);
 
-  while ((bytes = read(fd, buffer, 1024)) != 0) {
-    printf("Read %d bytes at offset %d\n", bytes, offset);
-    offset += bytes;
-
-    // Set load address of packet
-    dma_load_routine[DESTINATION_ADDRESS_OFFSET] = address & 0xff;
-    dma_load_routine[DESTINATION_ADDRESS_OFFSET + 1] = (address >> 8) & 0xff;
-
-    // Copy data into packet
-    memcpy(&dma_load_routine[DATA_OFFSET], buffer, bytes);
-
-    printf("Sending\n");
-    sendto(sockfd, dma_load_routine, sizeof dma_load_routine, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
-    usleep(150);
-
-    dma_load_routine[PACKET_NUMBER_OFFSET]++;
+  while ((bytes = read(fd, buffer, 1024)) > 0) {
+    ether_queue_load(address, buffer, bytes);
     address += bytes;
   }
+  close(fd);
 
-  // print out debug info
-  printf("Sent %s to %s on port %d.\n\n", argv[2], inet_ntoa(servaddr.sin_addr), ntohs(servaddr.sin_port));
-
-  if (1) {
-
-    printf("Now tell MEGA65 that we are all done");
-
-    int i;
-    for (i = 0; i < 10; i++) {
-
-      printf(".");
-
-      sendto(sockfd, all_done_routine, sizeof all_done_routine, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
-
-      usleep(150);
-    }
-
-    printf("\n");
-  }
+  // This is only sent once everything else has been acknowledged, so that
+  // it is run last.  Without acknowledgements, it is sent several times in
+  // case some are lost, as older versions of etherload did.
+  ether_queue_routine(all_done_routine, sizeof all_done_routine, acknowledged ? 1 : 10);
+  if (ether_send())
+    exit(-1);
+  ether_report(argv[2]);
 
   return 0;
 }
@@ -0,0 +1,621 @@
+/*
+  Host side of transfers to etherload and etherhyppo on a MEGA65.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/*
+  Packets are queued with ether_queue_routine() and ether_queue_load(), and then sent in order by
+  ether_send().
+
+  etherload acknowledges every packet, by sending back the acknowledgement template that we put
+  after the data, so up to window packets are sent before waiting for acknowledgements.  The
+  window grows by one packet for every window's worth of acknowledgements, and halves whenever a
+  packet has to be retransmitted, so that we send as fast as the MEGA65 can process the packets,
+  without overrunning its few RX buffers.  Packets are retransmitted when they have not been
+  acknowledged within the timeout, or when three packets sent after them have been acknowledged.
+  Routines that are not loads, such as the one that starts the loaded programme, are only sent
+  once everything before them has been acknowledged, so that they run last.
+
+  A rack of MEGA65s can be loaded at once, by sending to a broadcast or multicast address.  Each
+  board puts its MAC address in its acknowledgements, and a packet only counts as acknowledged
+  once ether_boards boards have acknowledged it, so the window runs at the pace of the slowest
+  board, and retransmissions repair whichever boards missed the packet.  As the routine that
+  starts the programme is sent once everything has been acknowledged by every board, they all
+  start together.
+
+  etherhyppo, and versions of etherload from before acknowledgements, do not acknowledge packets,
+  so for them the packets are just sent ether_pace_us apart, and routines are repeated.  Runs of
+  loads can also be sent more than once, as a whole, so that a burst of lost packets does not take
+  every copy of any of them.
+*/
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ethertransfer.h"
+
+unsigned char dma_load_routine[ROUTINE_SIZE + LOAD_CHUNK_SIZE] = {
+  // Routine that copies packet contents by DMA
+  0xa9, 0xff, 0x8d, 0x05, 0xd7, 0xad, 0x68, 0x68, 0x8d, 0x06, 0xd7, 0xa9, 0x0d, 0x8d, 0x02, 0xd7, 0xa9, 0xe8, 0x8d, 0x01,
+  0xd7, 0xa9, 0xff, 0x8d, 0x04, 0xd7, 0xa9, 0x5c, 0x8d, 0x00, 0xd7, 0xae, 0x67, 0x68, 0xea, 0x9d, 0x80, 0x06, 0xee, 0x26,
+  0x04, 0xd0, 0x03, 0xee, 0x25, 0x04, 0x60, 0x00,
+
+  // DMA list begins at offset $0030
+  0x00,             // DMA command ($0030)
+  0x00, 0x04,       // DMA byte count ($0031-$0032)
+  0x80, 0xe8, 0x8d, // DMA source address (points to data in packet)
+  0x00, 0x10,       // DMA Destination address (bottom 16 bits)
+  0x00,             // DMA Destination bank
+  0x00, 0x00,       // DMA modulo (ignored)
+  // Packet ID number at offset $003B
+  0x30,
+  // Destination MB at $003C
+  0x00, 0x00, 0x00, 0x00
+};
+
+// Loads with chains of DMA jobs.  This is dma_load_routine, with the
+// destination MB, DMA list and packet number moved, so that the list can be
+// as long as it needs to be.
+static unsigned char dma_list_routine[ROUTINE_SIZE + LOAD_CHUNK_SIZE] = {
+  0xa9, 0xff, 0x8d, 0x05, 0xd7, 0xad, 0x2c + LIST_MB_OFFSET, 0x68, 0x8d, 0x06, 0xd7, 0xa9, 0x0d, 0x8d, 0x02, 0xd7, 0xa9,
+  0xe8, 0x8d, 0x01, 0xd7, 0xa9, 0xff, 0x8d, 0x04, 0xd7, 0xa9, 0x2c + LIST_OFFSET, 0x8d, 0x00, 0xd7, 0xae,
+  0x2c + LIST_PACKET_NUMBER_OFFSET, 0x68, 0xea, 0x9d, 0x80, 0x06, 0xee, 0x26, 0x04, 0xd0, 0x03, 0xee, 0x25, 0x04, 0x60,
+  0x00
+};
+
+// Runs shorter than this are cheaper to send as they are, than to split
+// the copy they are in with a fill
+#define MIN_FILL_RUN 32
+
+#define MAX_WINDOW 64
+#define MIN_TIMEOUT_US 2000
+#define MAX_TIMEOUT_US 500000
+#define MAX_RETRIES 50
+#define PROGRESS_INTERVAL_US 500000
+
+int ether_pace_us = 150;
+int ether_load_passes = 1;
+int ether_compress = 0;
+int ether_boards = 1;
+char *ether_interface = NULL;
+
+struct packet {
+  unsigned char data[ETHER_PACKET_SIZE];
+  // Number of bytes loaded by the packet, or 0 if it is some other routine
+  int load_bytes;
+  // Number of times to send the packet, if it will not be acknowledged
+  int repeats;
+  // Boards that have acknowledged the packet, and how many
+  unsigned long long acked_by;
+  int acks;
+  // Set once every board has acknowledged the packet
+  int acked;
+  int sends;
+  long long sent_us;
+  // Number of later packets acknowledged since this one was last sent
+  int overtaken;
+};
+
+static struct packet *packets = NULL;
+static int packet_count = 0;
+static int packets_sent = 0;
+
+static struct sockaddr_in servaddr;
+static struct sockaddr_in localaddr;
+static int sockfd = -1;
+static int acknowledged = 0;
+
+// Boards are told apart by the MAC address in their acknowledgements
+static unsigned char board_macs[MAX_BOARDS][6];
+static int board_count = 0;
+
+// Statistics for ether_report()
+static long long transfer_start_us = 0;
+static long long transfer_us = 0;
+static long long bytes_loaded = 0;
+static long long routine_bytes = 0;
+static long long last_progress_us = 0;
+static int progress_shown = 0;
+static int retransmits = 0;
+static int board_repairs[MAX_BOARDS];
+
+static long long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int ether_open(char *ip_address, int port, int ack)
+{
+  acknowledged = ack;
+
+  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  int broadcastEnable = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, (char *)&broadcastEnable, sizeof(broadcastEnable));
+
+  bzero(&servaddr, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_addr.s_addr = inet_addr(ip_address);
+  servaddr.sin_port = htons(port);
+
+  // Work out which of our addresses the MEGA65 will see packets come from,
+  // so that it can send acknowledgements back to us.  The socket itself is
+  // not connected, as the acknowledgements will not come from a broadcast
+  // or multicast address.
+  socklen_t addrlen = sizeof(localaddr);
+  if (ether_interface) {
+    bzero(&localaddr, sizeof(localaddr));
+    localaddr.sin_family = AF_INET;
+    localaddr.sin_addr.s_addr = inet_addr(ether_interface);
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &localaddr.sin_addr, sizeof(localaddr.sin_addr));
+  }
+  else {
+    // Connecting to a broadcast address is refused without SO_BROADCAST
+    int probe = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(probe, SOL_SOCKET, SO_BROADCAST, (char *)&broadcastEnable, sizeof(broadcastEnable));
+    if (connect(probe, (struct sockaddr *)&servaddr, sizeof(servaddr))
+        || getsockname(probe, (struct sockaddr *)&localaddr, &addrlen)) {
+      if (acknowledged) {
+        perror("Could not find route to MEGA65");
+        close(probe);
+        return -1;
+      }
+      // Nothing will be sent back, so any address will do
+      bzero(&localaddr, sizeof(localaddr));
+      localaddr.sin_family = AF_INET;
+      localaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    close(probe);
+  }
+  localaddr.sin_port = 0;
+  if (bind(sockfd, (struct sockaddr *)&localaddr, sizeof(localaddr))
+      || getsockname(sockfd, (struct sockaddr *)&localaddr, &addrlen)) {
+    perror("bind");
+    return -1;
+  }
+  return 0;
+}
+
+static unsigned short ip_checksum(unsigned char *header, int len)
+{
+  unsigned int sum = 0;
+  for (int i = 0; i < len; i += 2)
+    sum += (header[i] << 8) | header[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return ~sum;
+}
+
+static void build_ack_template(unsigned char *t, unsigned int seq)
+{
+  // The MEGA65 answers from the address we sent to, unless that was a
+  // broadcast or multicast, in which case it is .65 on our network, as for
+  // ARP.
+  unsigned int mega65_ip = ntohl(servaddr.sin_addr.s_addr);
+  if ((mega65_ip & 0xff) == 0xff || IN_MULTICAST(mega65_ip))
+    mega65_ip = (ntohl(localaddr.sin_addr.s_addr) & 0xffffff00) | 65;
+  unsigned int host_ip = ntohl(localaddr.sin_addr.s_addr);
+  int udp_len = ACK_TEMPLATE_LENGTH - 20;
+
+  bzero(t, ACK_TEMPLATE_LENGTH);
+  t[0] = 0x45;
+  t[2] = ACK_TEMPLATE_LENGTH >> 8;
+  t[3] = ACK_TEMPLATE_LENGTH & 0xff;
+  t[4] = seq >> 8;
+  t[5] = seq & 0xff;
+  t[6] = 0x40; // Don't fragment
+  t[8] = 64;   // TTL
+  t[9] = 17;   // UDP
+  for (int i = 0; i < 4; i++) {
+    t[12 + i] = mega65_ip >> (24 - i * 8);
+    t[16 + i] = host_ip >> (24 - i * 8);
+  }
+  unsigned short checksum = ip_checksum(t, 20);
+  t[10] = checksum >> 8;
+  t[11] = checksum & 0xff;
+
+  // UDP header, without checksum
+  t[20] = ntohs(servaddr.sin_port) >> 8;
+  t[21] = ntohs(servaddr.sin_port) & 0xff;
+  t[22] = ntohs(localaddr.sin_port) >> 8;
+  t[23] = ntohs(localaddr.sin_port) & 0xff;
+  t[24] = udp_len >> 8;
+  t[25] = udp_len & 0xff;
+
+  memcpy(&t[28], ACK_MAGIC, 4);
+  for (int i = 0; i < 4; i++)
+    t[32 + i] = seq >> (i * 8);
+}
+
+static struct packet *add_packet(unsigned char *routine, int len)
+{
+  if (len > ACK_TEMPLATE_OFFSET) {
+    fprintf(stderr, "ERROR: Routine of %d bytes is too long.\n", len);
+    exit(-1);
+  }
+  if (!(packet_count & 0xff)) {
+    packets = realloc(packets, (packet_count + 0x100) * sizeof(struct packet));
+    if (!packets) {
+      perror("realloc()");
+      exit(-1);
+    }
+  }
+  struct packet *p = &packets[packet_count];
+  bzero(p, sizeof(struct packet));
+  memcpy(p->data, routine, len);
+  build_ack_template(&p->data[ACK_TEMPLATE_OFFSET], packet_count);
+  p->repeats = 1;
+  routine_bytes += len;
+  packet_count++;
+  return p;
+}
+
+int ether_queue_routine(unsigned char *routine, int len, int repeats)
+{
+  struct packet *p = add_packet(routine, len);
+  p->repeats = repeats;
+  return packet_count - 1;
+}
+
+static int run_length(unsigned char *data, int len, int limit)
+{
+  int run = 1;
+  while (run < len && run < limit && data[run] == data[0])
+    run++;
+  return run;
+}
+
+static void set_dma_job(unsigned char *job, int command, int count, unsigned int source, unsigned int address)
+{
+  job[0] = command;
+  job[1] = count & 0xff;
+  job[2] = count >> 8;
+  job[3] = source & 0xff;
+  job[4] = (source >> 8) & 0xff;
+  job[5] = source >> 16;
+  job[6] = address & 0xff;
+  job[7] = (address >> 8) & 0xff;
+  job[8] = (address >> 16) & 0x0f;
+  job[9] = 0;
+  job[10] = 0;
+}
+
+// Queues packets whose DMA jobs fill runs of the same byte, and copy
+// everything else from the packet.  Packets stay within a 64KB bank, as
+// the DMA destination wraps within it.
+static void queue_compressed_load(unsigned int address, unsigned char *data, int len)
+{
+  int space = ACK_TEMPLATE_OFFSET - LIST_OFFSET;
+  unsigned char jobs[space];
+  unsigned char literals[space];
+
+  for (int offset = 0; offset < len;) {
+    int job_count = 0;
+    int literal_count = 0;
+    int used = 0;
+    unsigned int start = address;
+    unsigned int bank = address & 0xfff0000;
+
+    while (offset < len && (address & 0xfff0000) == bank && used + DMA_JOB_SIZE < space) {
+      int limit = 0x10000 - (address & 0xffff);
+      if (limit > len - offset)
+        limit = len - offset;
+      int run = run_length(&data[offset], limit, 0xffff);
+      int command;
+      int count;
+      unsigned int source;
+
+      if (run >= MIN_FILL_RUN) {
+        command = DMA_FILL;
+        count = run;
+        source = data[offset];
+      }
+      else {
+        // Copy up to the next run that is worth filling
+        int room = space - used - DMA_JOB_SIZE;
+        if (limit > room)
+          limit = room;
+        count = 0;
+        while (count < limit && run_length(&data[offset + count], limit - count, MIN_FILL_RUN) < MIN_FILL_RUN)
+          count++;
+        command = DMA_COPY;
+        // Fixed up once we know where the literals start
+        source = literal_count;
+        memcpy(&literals[literal_count], &data[offset], count);
+        literal_count += count;
+        used += count;
+      }
+      set_dma_job(&jobs[job_count * DMA_JOB_SIZE], command, count, source, address);
+      job_count++;
+      used += DMA_JOB_SIZE;
+      offset += count;
+      address += count;
+    }
+
+    dma_list_routine[LIST_PACKET_NUMBER_OFFSET] = dma_load_routine[PACKET_NUMBER_OFFSET];
+    dma_list_routine[LIST_MB_OFFSET] = bank >> 20;
+    int literal_offset = LIST_OFFSET + job_count * DMA_JOB_SIZE;
+    for (int i = 0; i < job_count; i++) {
+      unsigned char *job = &jobs[i * DMA_JOB_SIZE];
+      if (i < job_count - 1)
+        job[0] |= DMA_CHAIN;
+      if ((job[0] & 0x03) == DMA_COPY) {
+        // The packet is at $FFDE82C, as seen by the DMA
+        unsigned int source = 0x8de82c + literal_offset + (job[3] | (job[4] << 8));
+        job[3] = source & 0xff;
+        job[4] = (source >> 8) & 0xff;
+        job[5] = source >> 16;
+      }
+    }
+    memcpy(&dma_list_routine[LIST_OFFSET], jobs, job_count * DMA_JOB_SIZE);
+    memcpy(&dma_list_routine[literal_offset], literals, literal_count);
+
+    struct packet *p = add_packet(dma_list_routine, literal_offset + literal_count);
+    p->load_bytes = address - start;
+
+    dma_load_routine[PACKET_NUMBER_OFFSET]++;
+  }
+}
+
+// Queues packets to load len bytes at the 28-bit address
+int ether_queue_load(unsigned int address, unsigned char *data, int len)
+{
+  if (ether_compress) {
+    queue_compressed_load(address, data, len);
+    return 0;
+  }
+
+  for (int offset = 0; offset < len;) {
+    int bytes = len - offset < LOAD_CHUNK_SIZE ? len - offset : LOAD_CHUNK_SIZE;
+    // The DMA destination wraps within its 64KB bank, so packets must not
+    // cross into the next one
+    if (bytes > 0x10000 - (address & 0xffff))
+      bytes = 0x10000 - (address & 0xffff);
+
+    dma_load_routine[BYTE_COUNT_OFFSET] = bytes & 0xff;
+    dma_load_routine[BYTE_COUNT_OFFSET + 1] = bytes >> 8;
+    dma_load_routine[DESTINATION_ADDRESS_OFFSET] = address & 0xff;
+    dma_load_routine[DESTINATION_ADDRESS_OFFSET + 1] = (address >> 8) & 0xff;
+    dma_load_routine[DESTINATION_BANK_OFFSET] = (address >> 16) & 0x0f;
+    dma_load_routine[DESTINATION_MB_OFFSET] = (address >> 20) & 0xff;
+    memcpy(&dma_load_routine[DATA_OFFSET], &data[offset], bytes);
+
+    struct packet *p = add_packet(dma_load_routine, DATA_OFFSET + LOAD_CHUNK_SIZE);
+    p->load_bytes = bytes;
+
+    dma_load_routine[PACKET_NUMBER_OFFSET]++;
+    address += bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+static void send_packet(int seq)
+{
+  struct packet *p = &packets[seq];
+  sendto(sockfd, p->data, ETHER_PACKET_SIZE, 0, (struct sockaddr *)&servaddr, sizeof(servaddr));
+  p->sends++;
+  p->sent_us = now_us();
+  p->overtaken = 0;
+}
+
+static void show_progress(void)
+{
+  long long now = now_us();
+  if (now - last_progress_us < PROGRESS_INTERVAL_US)
+    return;
+  last_progress_us = now;
+  progress_shown = 1;
+  fprintf(stderr, "\r%lld KB sent, %.1f KB/sec, %d retransmitted  ", bytes_loaded / 1024,
+      bytes_loaded / 1024.0 / ((now - transfer_start_us) / 1000000.0), retransmits);
+}
+
+// Returns the board with the MAC address, or -1 if there are already
+// ether_boards others
+static int find_board(unsigned char *mac)
+{
+  for (int i = 0; i < board_count; i++)
+    if (!memcmp(board_macs[i], mac, 6))
+      return i;
+  if (board_count >= ether_boards) {
+    fprintf(stderr, "\nWARNING: Ignoring acknowledgement from unexpected MEGA65 %02x:%02x:%02x:%02x:%02x:%02x\n", mac[0],
+        mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return -1;
+  }
+  memcpy(board_macs[board_count], mac, 6);
+  return board_count++;
+}
+
+// Sends packets first to last, which must all be acknowledged by every
+// board before returning
+static int send_window(int first, int last)
+{
+  int window = 2;
+  int acks_this_window = 0;
+  int next = first;
+  int in_flight = 0;
+  long long srtt_us = 0;
+  long long timeout_us = MAX_TIMEOUT_US / 10;
+  int remaining = last - first + 1;
+
+  while (remaining) {
+    while (next <= last && in_flight < window) {
+      send_packet(next++);
+      in_flight++;
+    }
+
+    // Retransmit anything that has taken too long, or been overtaken
+    long long now = now_us();
+    long long wait_us = timeout_us;
+    for (int i = first; i < next; i++) {
+      struct packet *p = &packets[i];
+      if (p->acked)
+        continue;
+      long long due = p->sent_us + timeout_us;
+      if (due <= now || p->overtaken >= 3) {
+        if (p->sends > MAX_RETRIES) {
+          if (ether_boards > 1)
+            fprintf(stderr, "\nERROR: Only %d of %d MEGA65s are acknowledging packets. Is etherload running?\n",
+                p->acks, ether_boards);
+          else
+            fprintf(stderr, "\nERROR: MEGA65 is not acknowledging packets. Is etherload running?\n");
+          fprintf(stderr, "Older versions of etherload do not acknowledge packets, and need -u.\n");
+          return -1;
+        }
+        send_packet(i);
+        retransmits++;
+        // Only back off once per window's worth of packets
+        if (acks_this_window >= 0) {
+          window = window > 2 ? window / 2 : 1;
+          acks_this_window = -window;
+        }
+        due = p->sent_us + timeout_us;
+      }
+      if (due - now < wait_us)
+        wait_us = due - now;
+    }
+
+    struct pollfd fds = { sockfd, POLLIN, 0 };
+    if (poll(&fds, 1, wait_us > 1000 ? wait_us / 1000 : 1) < 1)
+      continue;
+
+    unsigned char ack[ACK_PAYLOAD_LENGTH];
+    int len;
+    while ((len = recv(sockfd, ack, sizeof(ack), MSG_DONTWAIT)) > 0) {
+      if (len != ACK_PAYLOAD_LENGTH || memcmp(ack, ACK_MAGIC, 4))
+        continue;
+      unsigned int seq = ack[4] | (ack[5] << 8) | (ack[6] << 16) | ((unsigned int)ack[7] << 24);
+      if (seq < first || seq >= next || packets[seq].acked)
+        continue;
+      struct packet *p = &packets[seq];
+      int board = find_board(&ack[ACK_MAC_OFFSET]);
+      if (board < 0 || (p->acked_by & (1ULL << board)))
+        continue;
+      p->acked_by |= 1ULL << board;
+      // Count the packets that each board only got when they were repaired
+      if (p->sends > 1)
+        board_repairs[board]++;
+      if (++p->acks < ether_boards)
+        continue;
+      p->acked = 1;
+      bytes_loaded += p->load_bytes;
+      in_flight--;
+      remaining--;
+
+      // Only time packets that were sent once, as we can't tell which
+      // send a retransmitted packet's acknowledgement was for
+      if (p->sends == 1) {
+        long long rtt = now_us() - p->sent_us;
+        srtt_us = srtt_us ? (srtt_us * 7 + rtt) / 8 : rtt;
+        timeout_us = srtt_us * 4;
+        if (timeout_us < MIN_TIMEOUT_US)
+          timeout_us = MIN_TIMEOUT_US;
+        if (timeout_us > MAX_TIMEOUT_US)
+          timeout_us = MAX_TIMEOUT_US;
+      }
+      for (int i = first; i < (int)seq; i++)
+        if (!packets[i].acked && packets[i].sent_us <= p->sent_us)
+          packets[i].overtaken++;
+
+      if (++acks_this_window >= window && window < MAX_WINDOW) {
+        window++;
+        acks_this_window = 0;
+      }
+    }
+    show_progress();
+  }
+  return 0;
+}
+
+// Sends everything queued since the last call
+int ether_send(void)
+{
+  if (!transfer_start_us)
+    transfer_start_us = now_us();
+  long long start = now_us();
+  last_progress_us = start;
+  int result = 0;
+
+  if (acknowledged) {
+    // Loads can be overlapped, but other routines must wait for everything
+    // before them to finish, and for their own acknowledgement
+    int first = packets_sent;
+    for (int i = packets_sent; i < packet_count && !result; i++) {
+      if (packets[i].load_bytes && i < packet_count - 1)
+        continue;
+      if (first < i)
+        result = send_window(first, packets[i].load_bytes ? i : i - 1);
+      if (!result && !packets[i].load_bytes)
+        result = send_window(i, i);
+      first = i + 1;
+    }
+  }
+  else {
+    for (int i = packets_sent, next; i < packet_count; i = next) {
+      next = i + 1;
+      while (packets[i].load_bytes && next < packet_count && packets[next].load_bytes)
+        next++;
+      int passes = packets[i].load_bytes ? ether_load_passes : 1;
+      for (int pass = 0; pass < passes; pass++) {
+        for (int j = i; j < next; j++) {
+          for (int k = 0; k < packets[j].repeats; k++) {
+            send_packet(j);
+            usleep(ether_pace_us);
+          }
+          if (pass == passes - 1)
+            bytes_loaded += packets[j].load_bytes;
+          show_progress();
+        }
+      }
+    }
+  }
+  packets_sent = packet_count;
+  transfer_us += now_us() - start;
+  if (progress_shown)
+    fprintf(stderr, "\n");
+  progress_shown = 0;
+  return result;
+}
+
+void ether_report(char *what)
+{
+  double seconds = transfer_us / 1000000.0;
+  printf("Sent %s to %s on port %d.\n", what, inet_ntoa(servaddr.sin_addr), ntohs(servaddr.sin_port));
+  printf("%lld bytes in %d packets, %.3f seconds (%.1f KB/sec)", bytes_loaded, packet_count, seconds,
+      seconds > 0 ? bytes_loaded / 1024.0 / seconds : 0);
+  if (acknowledged)
+    printf(", %d packets retransmitted", retransmits);
+  printf(".\n");
+  if (ether_boards > 1) {
+    for (int i = 0; i < board_count; i++)
+      printf("MEGA65 %02x:%02x:%02x:%02x:%02x:%02x needed %d packets repaired.\n", board_macs[i][0], board_macs[i][1],
+          board_macs[i][2], board_macs[i][3], board_macs[i][4], board_macs[i][5], board_repairs[i]);
+  }
+  if (ether_compress && routine_bytes)
+    printf("Compressed to %lld bytes of DMA jobs and data (%.1f:1).\n", routine_bytes,
+        (double)bytes_loaded / routine_bytes);
+}
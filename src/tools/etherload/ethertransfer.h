@@ -0,0 +1,89 @@
+/*
+  Host side of transfers to etherload and etherhyppo on a MEGA65.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef ETHERTRANSFER_H
+#define ETHERTRANSFER_H
+
+#define ETHERLOAD_PORT 4510
+#define ETHERHYPPO_PORT 4511
+
+// Each packet is a routine that the MEGA65 calls, which must begin with
+// LDA #$nn.  Loading is done by a routine that DMAs the rest of the packet
+// into place.
+#define ROUTINE_SIZE 128
+#define LOAD_CHUNK_SIZE 1024
+
+#define BYTE_COUNT_OFFSET 0x31
+#define DESTINATION_ADDRESS_OFFSET 0x36
+#define DESTINATION_BANK_OFFSET 0x38
+#define PACKET_NUMBER_OFFSET 0x3b
+#define DESTINATION_MB_OFFSET 0x3c
+#define DATA_OFFSET (0x80 - 0x2c)
+// Length of the code at the start of the load routine, before the DMA list
+#define LOAD_ROUTINE_CODE_SIZE 0x30
+
+// Compressed loads use the same code, but with a chain of F018A DMA jobs,
+// that copy literal bytes from the packet, and fill runs of a single byte.
+#define LIST_PACKET_NUMBER_OFFSET 0x30
+#define LIST_MB_OFFSET 0x31
+#define LIST_OFFSET 0x34
+#define DMA_JOB_SIZE 11
+#define DMA_COPY 0x00
+#define DMA_FILL 0x03
+#define DMA_CHAIN 0x04
+
+// Packets also carry a ready-made IPv4 + UDP acknowledgement, which
+// etherload sends back before calling the routine.  The payload is
+// ACK_MAGIC followed by the 32-bit packet sequence number, and the MAC
+// address of the MEGA65, which etherload fills in, so that boards that
+// were sent packets by broadcast or multicast can be told apart.
+#define ACK_TEMPLATE_OFFSET 0x454
+#define ACK_TEMPLATE_LENGTH 42
+#define ACK_PAYLOAD_LENGTH 14
+#define ACK_MAC_OFFSET 8
+#define ACK_MAGIC "M65A"
+#define ETHER_PACKET_SIZE (ACK_TEMPLATE_OFFSET + ACK_TEMPLATE_LENGTH)
+
+extern unsigned char dma_load_routine[ROUTINE_SIZE + LOAD_CHUNK_SIZE];
+
+// Compress loads into chains of DMA jobs
+extern int ether_compress;
+
+// Number of MEGA65s that must acknowledge every packet
+#define MAX_BOARDS 64
+extern int ether_boards;
+
+// Address of the local interface to send from, if not the one that the
+// routing table would choose
+extern char *ether_interface;
+
+// Inter-packet gap for receivers that do not acknowledge packets
+extern int ether_pace_us;
+
+// Number of times to send all the loads to receivers that do not acknowledge
+// packets, so that fewer of them are lost
+extern int ether_load_passes;
+
+int ether_open(char *ip_address, int port, int acknowledged);
+int ether_queue_routine(unsigned char *routine, int len, int repeats);
+int ether_queue_load(unsigned int address, unsigned char *data, int len);
+int ether_send(void);
+void ether_report(char *what);
+
+#endif
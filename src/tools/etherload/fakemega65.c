@@ -0,0 +1,316 @@
+/*
+  Pretends to be a MEGA65 running etherload or etherhyppo, so that etherload and etherhyppo can be
+  tested and benchmarked over the loopback interface.
+
+  Packets that use dma_load_routine, or its compressed form, have their DMA jobs applied to an
+  in-memory copy of the 28-bit address space, and are acknowledged from the template in the
+  packet, as etherload.a65 does.  Any other routine is assumed to start the loaded programme, and
+  reports what has been received so far.
+
+  To test loading one MEGA65, several by multicast, and several by broadcast, with prog.bin
+  being prog.prg without its 2 byte load address of $2001:
+
+    fakemega65 -e -w got.bin -a 2001 -s <length> &
+    etherload 127.0.0.1 prog.prg && cmp got.bin prog.bin
+
+    fakemega65 -e -l 5 -m 40:40:40:40:40:01 -g 239.1.2.3 -w got1.bin -a 2001 -s <length> &
+    fakemega65 -e -l 5 -m 40:40:40:40:40:02 -g 239.1.2.3 -w got2.bin -a 2001 -s <length> &
+    etherload -n 2 239.1.2.3 prog.prg && cmp got1.bin prog.bin && cmp got2.bin prog.bin
+
+    fakemega65 -e -l 5 -m 40:40:40:40:40:01 -w got1.bin -a 2001 -s <length> &
+    fakemega65 -e -l 5 -m 40:40:40:40:40:02 -w got2.bin -a 2001 -s <length> &
+    etherload -n 2 <broadcast address of a local interface> prog.prg && cmp ...
+
+  Every fake MEGA65 shares the port, and loses different packets.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "ethertransfer.h"
+
+#define MEMORY_SIZE (1 << 28)
+
+unsigned char *memory;
+
+int loss_percent = 0;
+int delay_us = 0;
+int exit_after_routine = 0;
+unsigned char mac[6] = { 0x40, 0x40, 0x40, 0x40, 0x40, 0x40 };
+char *dump_file = NULL;
+unsigned int dump_address = 0;
+unsigned int dump_length = 0;
+
+// Statistics since the last routine
+long long packets_received = 0;
+long long packets_dropped = 0;
+long long loads = 0;
+long long bytes_loaded = 0;
+long long acks_sent = 0;
+struct timespec first_packet;
+unsigned char last_routine[ROUTINE_SIZE];
+
+void usage(void)
+{
+  fprintf(stderr, "usage: fakemega65 [-p port] [-l loss%%] [-d delay us] [-b rx buffers] [-e] [-m MAC address]\n"
+                  "                  [-g multicast group [-i interface address]] [-w file -a hex address -s hex length]\n"
+                  "  -p  UDP port to listen on: %d for etherload (default), %d for etherhyppo\n"
+                  "  -m  MAC address to put in acknowledgements, to tell several fake MEGA65s apart\n"
+                  "  -g  also receive packets sent to the multicast group, on the interface with the address\n"
+                  "  -l  percentage of received packets to drop\n"
+                  "  -d  time taken to process each packet, in microseconds\n"
+                  "  -b  number of packets that can be waiting, as the MEGA65 has few RX buffers\n"
+                  "  -e  exit after the first routine that is not a load\n"
+                  "  -w  write memory from -a for -s bytes to file when a routine is run\n",
+      ETHERLOAD_PORT, ETHERHYPPO_PORT);
+  exit(-3);
+}
+
+// Operands in dma_load_routine that say where the destination MB, DMA list
+// and packet number are, which differ between plain and compressed loads
+#define MB_OPERAND 6
+#define LIST_OPERAND 27
+#define PACKET_NUMBER_OPERAND 32
+
+// Where the packet is, as seen by the CPU and by the DMA
+#define PACKET_CPU_ADDRESS 0x682c
+#define PACKET_DMA_ADDRESS 0x8de82c
+
+int is_load_packet(unsigned char *packet, int len)
+{
+  if (len < LOAD_ROUTINE_CODE_SIZE)
+    return 0;
+  for (int i = 0; i < LOAD_ROUTINE_CODE_SIZE; i++)
+    if (i != MB_OPERAND && i != LIST_OPERAND && i != PACKET_NUMBER_OPERAND && packet[i] != dma_load_routine[i])
+      return 0;
+  return 1;
+}
+
+// Runs the chain of F018A DMA jobs that the packet points at
+void apply_load(unsigned char *packet, int len)
+{
+  int mb_offset = packet[MB_OPERAND] + (packet[MB_OPERAND + 1] << 8) - PACKET_CPU_ADDRESS;
+  int offset = packet[LIST_OPERAND] + 0xe800 - (PACKET_DMA_ADDRESS & 0xffff);
+  if (mb_offset < 0 || mb_offset >= len)
+    return;
+  unsigned int mb = packet[mb_offset] << 20;
+
+  while (offset >= 0 && offset + DMA_JOB_SIZE <= len) {
+    unsigned char *job = &packet[offset];
+    int count = job[1] | (job[2] << 8);
+    unsigned int source = job[3] | (job[4] << 8) | (job[5] << 16);
+    unsigned int address = mb | ((job[8] & 0x0f) << 16) | job[6] | (job[7] << 8);
+    if (!count)
+      count = 0x10000;
+
+    if ((job[0] & 0x03) == DMA_FILL) {
+      // The DMA address wraps within the bank, as on the real thing
+      for (int i = 0; i < count; i++)
+        memory[(address & 0xfff0000) | ((address + i) & 0xffff)] = source & 0xff;
+    }
+    else if ((job[0] & 0x03) == DMA_COPY) {
+      int data_offset = source - PACKET_DMA_ADDRESS;
+      // Sources outside the packet are not something we are sent
+      if (data_offset < 0 || data_offset + count > len) {
+        fprintf(stderr, "DMA copy from $%06x is outside the packet.\n", source);
+        return;
+      }
+      for (int i = 0; i < count; i++)
+        memory[(address & 0xfff0000) | ((address + i) & 0xffff)] = packet[data_offset + i];
+    }
+    bytes_loaded += count;
+    if (!(job[0] & DMA_CHAIN))
+      break;
+    offset += DMA_JOB_SIZE;
+  }
+  loads++;
+}
+
+void send_ack(int sockfd, unsigned char *packet, int len)
+{
+  unsigned char *t = &packet[ACK_TEMPLATE_OFFSET];
+  // etherload.a65 only answers packets that carry a template
+  if (len < ETHER_PACKET_SIZE || t[0] != 0x45)
+    return;
+  struct sockaddr_in to;
+  bzero(&to, sizeof(to));
+  to.sin_family = AF_INET;
+  memcpy(&to.sin_addr.s_addr, &t[16], 4);
+  memcpy(&to.sin_port, &t[22], 2);
+  memcpy(&t[28 + ACK_MAC_OFFSET], mac, 6);
+  sendto(sockfd, &t[28], ACK_PAYLOAD_LENGTH, 0, (struct sockaddr *)&to, sizeof(to));
+  acks_sent++;
+}
+
+void report(unsigned char *routine)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double seconds = now.tv_sec - first_packet.tv_sec + (now.tv_nsec - first_packet.tv_nsec) / 1000000000.0;
+  printf("Routine $%02x $%02x $%02x ... run after %.3f seconds.\n", routine[0], routine[1], routine[2], seconds);
+  printf("%lld packets received, %lld dropped, %lld acknowledged.\n", packets_received, packets_dropped, acks_sent);
+  printf("%lld loads of %lld bytes (%.1f KB/sec).\n", loads, bytes_loaded,
+      seconds > 0 ? bytes_loaded / 1024.0 / seconds : 0);
+
+  if (dump_file) {
+    FILE *f = fopen(dump_file, "wb");
+    if (!f || fwrite(&memory[dump_address], dump_length, 1, f) != 1) {
+      perror("Could not write memory dump");
+      exit(-1);
+    }
+    fclose(f);
+    printf("Wrote $%07x-$%07x to %s.\n", dump_address, dump_address + dump_length - 1, dump_file);
+  }
+  fflush(stdout);
+
+  packets_received = packets_dropped = loads = bytes_loaded = acks_sent = 0;
+}
+
+int main(int argc, char **argv)
+{
+  int port = ETHERLOAD_PORT;
+  int rx_buffers = 0;
+  char *group = NULL;
+  char *interface = "0.0.0.0";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "a:b:d:eg:i:l:m:p:s:w:")) != -1) {
+    switch (opt) {
+    case 'a':
+      dump_address = strtoul(optarg, NULL, 16);
+      break;
+    case 'b':
+      rx_buffers = atoi(optarg);
+      break;
+    case 'd':
+      delay_us = atoi(optarg);
+      break;
+    case 'e':
+      exit_after_routine = 1;
+      break;
+    case 'g':
+      group = optarg;
+      break;
+    case 'i':
+      interface = optarg;
+      break;
+    case 'l':
+      loss_percent = atoi(optarg);
+      break;
+    case 'm':
+      if (sscanf(optarg, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) != 6)
+        usage();
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      dump_length = strtoul(optarg, NULL, 16);
+      break;
+    case 'w':
+      dump_file = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc || (dump_file && (!dump_length || dump_address + dump_length > MEMORY_SIZE)))
+    usage();
+
+  // Fake MEGA65s that share a port must not all lose the same packets
+  srandom(getpid());
+
+  // Pages are only allocated when they are first written
+  memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("mmap()");
+    exit(-1);
+  }
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (rx_buffers) {
+    // The kernel doubles this, and counts its own overheads against it
+    int size = rx_buffers * ETHER_PACKET_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  // Several fake MEGA65s can then share the port, and all get the broadcast
+  // and multicast packets
+  int reuse = 1;
+  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr))) {
+    perror("bind");
+    exit(-1);
+  }
+  if (group) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(group);
+    mreq.imr_interface.s_addr = inet_addr(interface);
+    if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+      perror("Could not join multicast group");
+      exit(-1);
+    }
+  }
+  printf("Listening on port %d.\n", port);
+  fflush(stdout);
+
+  unsigned char packet[2048];
+  int len;
+  while ((len = recv(sockfd, packet, sizeof(packet), 0)) >= 0) {
+    if (!packets_received)
+      clock_gettime(CLOCK_MONOTONIC, &first_packet);
+    packets_received++;
+    if (loss_percent && random() % 100 < loss_percent) {
+      packets_dropped++;
+      continue;
+    }
+    if (delay_us)
+      usleep(delay_us);
+
+    // Every packet is a routine, which must start with LDA #$nn
+    if (len < 2 || packet[0] != 0xa9)
+      continue;
+    // etherload acknowledges packets before running them
+    if (port != ETHERHYPPO_PORT)
+      send_ack(sockfd, packet, len);
+    if (is_load_packet(packet, len))
+      apply_load(packet, len);
+    else if (loads || memcmp(packet, last_routine, ROUTINE_SIZE)) {
+      // etherhyppo sends routines several times, in case some are lost
+      memcpy(last_routine, packet, ROUTINE_SIZE);
+      report(packet);
+      if (exit_after_routine)
+        break;
+    }
+  }
+  return 0;
+}
@@ -40,6 +40,9 @@
 #include <netdb.h>
 #include <time.h>
 #include <pcap.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 char *match_string = NULL;
 int num_instructions = 999999999;
@@ -120,12 +123,141 @@ char *oplist[] = { "00   BRK\n", "01   ORA ($nn,X)\n", "02   CLE\n", "03   SEE\n
   "F9   SBC $nnnn,Y\n", "FA   PLX\n", "FB   PLZ\n", "FC   PHW $nnnn\n", "FD   SBC $nnnn,X\n", "FE   INC $nnnn,X\n",
   "FF   BBS7 $nn,$rr\n", NULL };
 
+/* ----------------------------------------------------------------------------------------------------------
+   Annotations
+   ----------------------------------------------------------------------------------------------------------
+
+   Each address can have any number of source lines, from the annotation files.  Source files are mapped
+   rather than read, and only the offset of each line is kept, so annotating even a large program costs
+   a few bytes per line and per address.  The annotation text is made from the mapped file when the
+   instruction is displayed.
+*/
+
+struct source_file {
+  char *name;
+  // Name without any directories, as shown in annotations
+  char *basename;
+  char *data;
+  size_t size;
+  // Offset of the start of each line, plus one for the end of the file
+  unsigned int *line_offsets;
+  int line_count;
+};
+
+#define MAX_SOURCES 2048
+#define SOURCE_HASH_SIZE 4096
+struct source_file source_files[MAX_SOURCES];
+int source_file_count = 0;
+// Index + 1 of the source file with each hashed name, with linear probing
+unsigned short source_file_hash[SOURCE_HASH_SIZE] = { 0 };
+
 struct annotation {
-  char *text;
-  struct annotation *next;
+  int source;
+  int line;
+  // Next annotation for the same address, or -1
+  int next;
 };
 
-struct annotation *annotations[0x10000] = { NULL };
+struct annotation *annotation_list = NULL;
+int annotation_count = 0;
+// First annotation for each address, or -1
+int annotations[0x10000];
+
+int load_source_file(struct source_file *s)
+{
+  int fd = open(s->name, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return -1;
+  }
+  s->size = st.st_size;
+  s->data = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (s->data == MAP_FAILED) {
+    s->data = NULL;
+    return -1;
+  }
+
+  int count = 0;
+  for (char *p = s->data; (p = memchr(p, '\n', s->data + s->size - p)); p++)
+    count++;
+  if (s->data[s->size - 1] != '\n')
+    count++;
+  s->line_offsets = malloc((count + 1) * sizeof(unsigned int));
+  if (!s->line_offsets) {
+    perror("malloc()");
+    exit(-1);
+  }
+  char *p = s->data;
+  for (int i = 0; i < count; i++) {
+    s->line_offsets[i] = p - s->data;
+    p = memchr(p, '\n', s->data + s->size - p);
+    p = p ? p + 1 : s->data + s->size;
+  }
+  s->line_offsets[count] = s->size;
+  s->line_count = count;
+  return 0;
+}
+
+// Returns the source file with the given name, loading it if necessary.
+// Files that cannot be read are still remembered, so that annotations can
+// name them, and so that they are only tried once.
+int find_source_file(char *name)
+{
+  unsigned int h = 2166136261U;
+  for (int i = 0; name[i]; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619U;
+  h &= SOURCE_HASH_SIZE - 1;
+  while (source_file_hash[h]) {
+    if (!strcmp(source_files[source_file_hash[h] - 1].name, name))
+      return source_file_hash[h] - 1;
+    h = (h + 1) & (SOURCE_HASH_SIZE - 1);
+  }
+  if (source_file_count == MAX_SOURCES) {
+    fprintf(stderr, "Too many source files, ignoring '%s'.\n", name);
+    return -1;
+  }
+
+  struct source_file *s = &source_files[source_file_count];
+  s->name = strdup(name);
+  s->basename = strrchr(s->name, '/') ? strrchr(s->name, '/') + 1 : s->name;
+  load_source_file(s);
+  source_file_hash[h] = ++source_file_count;
+  return source_file_count - 1;
+}
+
+// Returns line number line (from 1) of a source file, and its length without
+// the line ending, or NULL if the file does not have that line
+const char *find_source_line(struct source_file *s, int line, int *len)
+{
+  if (line < 1 || line > s->line_count)
+    return NULL;
+  const char *text = s->data + s->line_offsets[line - 1];
+  *len = s->line_offsets[line] - s->line_offsets[line - 1];
+  // Trim CRLF etc
+  while (*len && text[*len - 1] < ' ')
+    (*len)--;
+  return text;
+}
+
+int format_annotation(char *out, int size, struct annotation *a)
+{
+  struct source_file *s = &source_files[a->source];
+  int len;
+  const char *text = find_source_line(s, a->line, &len);
+  if (!text)
+    return snprintf(out, size, "%s:%d", s->basename, a->line);
+  while (len && (text[0] == '\t' || text[0] == ' ')) {
+    text++;
+    len--;
+  }
+  if (len > 1000)
+    len = 1000;
+  return snprintf(out, size, "%s:%d: %.*s", s->basename, a->line, len, text);
+}
 
 char *opnames[256] = { NULL };
 char *modes[256] = { NULL };
@@ -133,7 +265,7 @@ char *modes[256] = { NULL };
 int instruction_address = 0xFFFF;
 
 int last_d031_toggle = 0;
-unsigned int instruction_count = 0;
+unsigned long long instruction_count = 0;
 
 int one_frame = 0;
 int one_frame_active = 0;
@@ -141,11 +273,69 @@ int one_frame_active = 0;
 int logged_instruction_count = 0;
 char *logged_instructions[16] = { NULL };
 
+// Work out the address of the following instruction from a trace record,
+// given the address of the instruction it describes
+int next_instruction_address(const unsigned char *b, int load_address)
+{
+  int address = (b[1] << 8) + b[0];
+  // JSR passes PC+1 instead of PC of next instruction, so adjust
+  switch (b[2]) {
+  case 0x6c:
+  case 0x4c:
+    // jump leaves correct address
+    break;
+  case 0xf0:
+  case 0xd0:
+    // Branches taken leave correct address, but
+    // untaken branches do not.
+    if (address != (load_address + 2))
+      break;
+    /* fall through */
+  default:
+    address--;
+  }
+  return address & 0xffff;
+}
+
+// Records that are raster markers rather than instructions
+static inline int is_raster_record(const unsigned char *b)
+{
+  return (b[0] & b[1] & b[2]) == 0xff;
+}
+
+// VIC-IV raster line of a raster marker
+static inline int record_raster(const unsigned char *b)
+{
+  return b[3] | ((b[4] & 0xf) << 8);
+}
+
+// Raster markers at the start of a new frame
+static inline int is_frame_record(const unsigned char *b)
+{
+  return is_raster_record(b) && (b[7] & 0x80) && !(b[3] | (b[4] & 0xf));
+}
+
+// Set while decoding an instruction that matched a trigger (-t)
+int trigger_matched = 0;
+
+// Number of instructions to decode silently after seeking, so that the
+// address of the first displayed instruction is known
+unsigned long long skip_instructions = 0;
+
 int decode_instruction(const unsigned char *b)
 {
   char out[8192] = "";
   int out_len = 0;
 
+  if (skip_instructions) {
+    if (!is_raster_record(b)) {
+      skip_instructions--;
+      instruction_count++;
+      instruction_address = next_instruction_address(b, instruction_address);
+    }
+    return 0;
+  }
+
   // Limit number of instructions shown
   // (unless we have a match string, in which case we display 16 instructions before and after each match)
   if (num_instructions)
@@ -160,7 +350,7 @@ int decode_instruction(const unsigned char *b)
 
   if ((b[0] & b[1] & b[2]) == 0xff) {
     // Raster / badline marker
-    int viciv_raster = b[3] | ((b[4] & 0xf) << 4);
+    int viciv_raster = record_raster(b);
     int vicii_raster = (b[4] >> 4) + (b[5] << 4);
     int raster = b[7] & 0x80;
     int badline = b[7] & 0x40;
@@ -194,7 +384,7 @@ int decode_instruction(const unsigned char *b)
 
   int d031_toggle = b[7] & 0x80;
 
-  out_len += snprintf(&out[out_len], 8192 - out_len, "%08x ", instruction_count++);
+  out_len += snprintf(&out[out_len], 8192 - out_len, "%08llx ", instruction_count++);
   //    if (d031_toggle!=last_d031_toggle) {
   //      out_len+=snprintf(&out[out_len],8192-out_len,"[$D031 written to!] ");
   //    }
@@ -297,33 +487,18 @@ int decode_instruction(const unsigned char *b)
     out_len += snprintf(&out[out_len], 8192 - out_len, " ");
     c++;
   }
-  struct annotation *a = annotations[load_address];
-  while (a) {
-    out_len += snprintf(&out[out_len], 8192 - out_len, "%s\n", a->text);
-    if (a->next)
+  for (int a = annotations[load_address]; a != -1; a = annotation_list[a].next) {
+    if (out_len > 8192 - 1100)
+      break;
+    out_len += format_annotation(&out[out_len], 8192 - out_len, &annotation_list[a]);
+    out_len += snprintf(&out[out_len], 8192 - out_len, "\n");
+    if (annotation_list[a].next != -1)
       out_len += snprintf(&out[out_len], 8192 - out_len, "                                       ");
-    a = a->next;
   }
   out_len += snprintf(&out[out_len], 8192 - out_len, "\n");
 
   // Remember instruction address for next display
-  instruction_address = (b[1] << 8) + b[0];
-  // JSR passes PC+1 instead of PC of next instruction, so adjust
-  switch (opcode) {
-  case 0x6c:
-  case 0x4c:
-    // jump leaves correct address
-    break;
-  case 0xf0:
-  case 0xd0:
-    // Branches taken leave correct address, but
-    // untaken branches do not.
-    if (instruction_address != (load_address + 2))
-      break;
-    /* fall through */
-  default:
-    instruction_address--;
-  }
+  instruction_address = next_instruction_address(b, load_address);
 
   if (match_string) {
     if (strstr(out, match_string)) {
@@ -356,7 +531,7 @@ int decode_instruction(const unsigned char *b)
       logged_instruction_count++;
   }
   if (num_instructions || (!match_string))
-    printf("%s %s", (match_string && strstr(out, match_string)) ? ">>>" : "   ", out);
+    printf("%s %s", ((match_string && strstr(out, match_string)) || trigger_matched) ? ">>>" : "   ", out);
 
   return 0;
 }
@@ -397,53 +572,1095 @@ int decode_busaccess(const unsigned char *b)
   return 0;
 }
 
-#define MAX_LINES 65536
-struct source_file {
-  char *name;
-  int line_count;
-  char *lines[MAX_LINES];
+/* ----------------------------------------------------------------------------------------------------------
+   Sampling profiler
+   ----------------------------------------------------------------------------------------------------------
+
+   Every instruction in the trace stream is a sample.  The flat profile is a histogram of instruction
+   addresses, attributed to routines at report time using the labels found in the annotation files.
+   For the call stacks, a shadow stack is kept by following JSR/BSR and RTS, as a tree of call nodes
+   so that each sample is only a counter increment.  Interrupt entry is not visible in the trace, so
+   interrupt handlers are counted as part of whatever they interrupted.
+*/
+
+char *symbol_names[0x10000] = { NULL };
+
+// Symbol number for each address, i.e., the nearest label at or below it.
+// Symbol 0 is used for addresses below the first label.
+unsigned short address_symbol[0x10000];
+char **symbols = NULL;
+int symbol_count = 0;
+
+#define PROFILE_REPORT_INTERVAL (1 << 22)
+#define PROFILE_TOP_ROUTINES 20
+#define MAX_CALL_NODES 65536
+#define MAX_CALL_DEPTH 256
+
+char *profile_file = NULL;
+unsigned long long pc_samples[0x10000] = { 0 };
+unsigned long long profile_samples = 0;
+
+struct call_node {
+  int parent;
+  int symbol;
+  unsigned long long samples;
 };
 
-#define MAX_SOURCES 256
-struct source_file source_files[MAX_SOURCES];
-int source_file_count = 0;
+struct call_node call_nodes[MAX_CALL_NODES];
+int call_node_count = 0;
+// Open addressed hash of (parent, symbol) to call node, for finding callees
+int call_node_hash[MAX_CALL_NODES * 2];
+
+int current_call_node = 0;
+int call_depth = 0;
+// Calls made once MAX_CALL_DEPTH or MAX_CALL_NODES is reached are not given
+// nodes of their own, but still have to be matched with their returns.
+int untracked_calls = 0;
+int call_pending = 0;
+
+void record_symbol(int addr, const char *source_line, int len)
+{
+  // Labels start in the first column.  Local and anonymous labels, directives
+  // and comments are skipped, as they would split up routines.
+  if (symbol_names[addr] || !len)
+    return;
+  if (!((source_line[0] >= 'A' && source_line[0] <= 'Z') || (source_line[0] >= 'a' && source_line[0] <= 'z')))
+    return;
+  int i = 0;
+  while (i < len
+         && (source_line[i] == '_' || (source_line[i] >= '0' && source_line[i] <= '9')
+             || (source_line[i] >= 'A' && source_line[i] <= 'Z') || (source_line[i] >= 'a' && source_line[i] <= 'z')))
+    i++;
+  if (i < len && source_line[i] != ':' && source_line[i] != ' ' && source_line[i] != '\t')
+    return;
+  symbol_names[addr] = strndup(source_line, i);
+}
+
+int call_node_child(int parent, int symbol)
+{
+  unsigned int h = (parent * 65599 + symbol) & (MAX_CALL_NODES * 2 - 1);
+  while (call_node_hash[h] != -1) {
+    struct call_node *n = &call_nodes[call_node_hash[h]];
+    if (n->parent == parent && n->symbol == symbol)
+      return call_node_hash[h];
+    h = (h + 1) & (MAX_CALL_NODES * 2 - 1);
+  }
+  if (call_node_count == MAX_CALL_NODES)
+    return -1;
+  call_nodes[call_node_count].parent = parent;
+  call_nodes[call_node_count].symbol = symbol;
+  call_nodes[call_node_count].samples = 0;
+  call_node_hash[h] = call_node_count;
+  return call_node_count++;
+}
+
+void profile_init(void)
+{
+  symbols = malloc(sizeof(char *) * 0x10001);
+  if (!symbols) {
+    perror("malloc()");
+    exit(-1);
+  }
+  symbols[symbol_count++] = "[unknown]";
+  for (int addr = 0; addr < 0x10000; addr++) {
+    if (symbol_names[addr])
+      symbols[symbol_count++] = symbol_names[addr];
+    address_symbol[addr] = symbol_count - 1;
+  }
+  fprintf(stderr, "Profiling with %d symbols.\n", symbol_count - 1);
+
+  for (int i = 0; i < MAX_CALL_NODES * 2; i++)
+    call_node_hash[i] = -1;
+  // Node 0 is the root, which has no routine of its own
+  call_nodes[0].parent = -1;
+  call_nodes[0].symbol = -1;
+  call_node_count = 1;
+}
 
-char *find_source_line(char *file, int line)
+void write_collapsed_stack(FILE *f, int node)
 {
-  int num;
-  line--;
-  for (num = 0; num < source_file_count; num++) {
-    if (!strcmp(source_files[num].name, file))
+  if (call_nodes[node].parent > 0) {
+    write_collapsed_stack(f, call_nodes[node].parent);
+    fputc(';', f);
+  }
+  fputs(symbols[call_nodes[node].symbol], f);
+}
+
+int write_collapsed_stacks(char *filename)
+{
+  // Write to a temporary file first, so that the file is always complete
+  // when read by other tools while we are running
+  char tmp[1024];
+  snprintf(tmp, 1024, "%s.tmp", filename);
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open '%s' for writing.\n", tmp);
+    return -1;
+  }
+  for (int i = 1; i < call_node_count; i++) {
+    if (!call_nodes[i].samples)
+      continue;
+    write_collapsed_stack(f, i);
+    fprintf(f, " %lld\n", call_nodes[i].samples);
+  }
+  fclose(f);
+  if (rename(tmp, filename)) {
+    perror("rename");
+    return -1;
+  }
+  return 0;
+}
+
+int report_profile(void)
+{
+  unsigned long long *routine_samples = calloc(symbol_count, sizeof(unsigned long long));
+  int *hottest_address = calloc(symbol_count, sizeof(int));
+  int *order = malloc(symbol_count * sizeof(int));
+  if (!routine_samples || !hottest_address || !order) {
+    perror("calloc()");
+    exit(-1);
+  }
+  for (int addr = 0; addr < 0x10000; addr++) {
+    int sym = address_symbol[addr];
+    routine_samples[sym] += pc_samples[addr];
+    if (pc_samples[addr] > pc_samples[hottest_address[sym]])
+      hottest_address[sym] = addr;
+  }
+
+  // Partial selection sort, as only the top few are needed
+  int shown = 0;
+  for (int i = 0; i < symbol_count; i++)
+    order[i] = i;
+  for (; shown < PROFILE_TOP_ROUTINES && shown < symbol_count; shown++) {
+    int best = shown;
+    for (int i = shown + 1; i < symbol_count; i++)
+      if (routine_samples[order[i]] > routine_samples[order[best]])
+        best = i;
+    if (!routine_samples[order[best]])
       break;
+    int t = order[shown];
+    order[shown] = order[best];
+    order[best] = t;
+  }
+
+  printf("Profile of %lld instructions:\n", profile_samples);
+  printf("   samples       %%  hottest  routine\n");
+  for (int i = 0; i < shown; i++) {
+    int sym = order[i];
+    printf("%10lld  %5.1f%%   $%04X   %s\n", routine_samples[sym], routine_samples[sym] * 100.0 / profile_samples,
+        hottest_address[sym], symbols[sym]);
+  }
+  printf("\n");
+  fflush(stdout);
+
+  free(routine_samples);
+  free(hottest_address);
+  free(order);
+
+  return write_collapsed_stacks(profile_file);
+}
+
+void profile_instruction(const unsigned char *b)
+{
+  if (skip_instructions) {
+    decode_instruction(b);
+    return;
+  }
+  if (is_raster_record(b))
+    return;
+
+  int addr = instruction_address;
+  instruction_address = next_instruction_address(b, addr);
+  pc_samples[addr]++;
+
+  // Calls get their node on the first instruction of the callee, when the
+  // routine being entered is known.  At the top level there is no caller to
+  // return to, so the node follows whichever routine is running.
+  if (call_pending) {
+    int node = call_depth < MAX_CALL_DEPTH ? call_node_child(current_call_node, address_symbol[addr]) : -1;
+    if (node == -1)
+      untracked_calls++;
+    else {
+      current_call_node = node;
+      call_depth++;
+    }
+    call_pending = 0;
+  }
+  else if (!call_depth && call_nodes[current_call_node].symbol != address_symbol[addr]) {
+    int node = call_node_child(0, address_symbol[addr]);
+    if (node != -1)
+      current_call_node = node;
+  }
+  call_nodes[current_call_node].samples++;
+
+  switch (b[2]) {
+  case 0x20: // JSR $nnnn
+  case 0x22: // JSR ($nnnn)
+  case 0x23: // JSR ($nnnn,X)
+  case 0x63: // BSR $rrrr
+    call_pending = 1;
+    break;
+  case 0x60: // RTS
+  case 0x62: // RTS #$nn
+    if (untracked_calls)
+      untracked_calls--;
+    else if (call_depth) {
+      call_depth--;
+      current_call_node = call_nodes[current_call_node].parent;
+    }
+    break;
+  }
+
+  if (!(++profile_samples % PROFILE_REPORT_INTERVAL))
+    report_profile();
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Triggers
+   ----------------------------------------------------------------------------------------------------------
+
+   A trigger is a list of conditions on the raw trace records, all of which must hold, e.g.:
+
+     pc=$0800-$08ff op=sta io=$d020-$d021 write raster=$40-$48
+
+   Several triggers can be given, any of which can match.  Each trigger is compiled into a table of
+   acceptable opcodes, which also covers the read/write and IO address conditions that depend on the
+   addressing mode, and ranges for everything else, so that records can be tested before any formatting.
+   Like a logic analyser, a window of instructions before and after each match is displayed.
+
+   The IO address is the absolute operand of the instruction, as bus accesses are not in the instruction
+   trace.  Indexed modes match on the base address.
+*/
+
+#define MAX_TRIGGERS 16
+
+struct trigger {
+  unsigned char opcodes[256];
+  int pc_low, pc_high;
+  int io_low, io_high;
+  int raster_low, raster_high;
+};
+
+struct trigger triggers[MAX_TRIGGERS];
+int trigger_count = 0;
+char *trigger_expressions[MAX_TRIGGERS];
+int trigger_expression_count = 0;
+
+int trigger_before = 16;
+int trigger_after = 16;
+int trigger_remaining = 0;
+int current_raster = 0;
+
+// Instructions before the next match, with the state needed to decode them
+struct held_record {
+  unsigned char b[8];
+  int address;
+  unsigned long long count;
+};
+
+#define MAX_TRIGGER_WINDOW 4096
+struct held_record held_records[MAX_TRIGGER_WINDOW];
+unsigned int held_record_count = 0;
+
+int opcode_writes(int opcode)
+{
+  char *op = opnames[opcode];
+  return !strncmp(op, "ST", 2) || !strcmp(op, "INC") || !strcmp(op, "DEC") || !strcmp(op, "ASL") || !strcmp(op, "LSR")
+         || !strcmp(op, "ROL") || !strcmp(op, "ROR") || !strcmp(op, "TSB") || !strcmp(op, "TRB") || !strcmp(op, "ASR")
+         || !strcmp(op, "INW") || !strcmp(op, "DEW") || !strcmp(op, "ASW") || !strcmp(op, "ROW")
+         || !strncmp(op, "RMB", 3) || !strncmp(op, "SMB", 3);
+}
+
+int opcode_reads(int opcode)
+{
+  char *op = opnames[opcode];
+  return strncmp(op, "ST", 2) && strncmp(op, "JMP", 3) && strncmp(op, "JSR", 3);
+}
+
+// Parses a number or range, e.g. $d020, 53280 or $0800-$08ff
+int parse_range(char *s, int *low, int *high)
+{
+  char *end;
+  *low = strtol(s[0] == '$' ? s + 1 : s, &end, s[0] == '$' ? 16 : 0);
+  if (end == s)
+    return -1;
+  *high = *low;
+  if (*end == '-') {
+    s = end + 1;
+    *high = strtol(s[0] == '$' ? s + 1 : s, &end, s[0] == '$' ? 16 : 0);
+  }
+  return *end ? -1 : 0;
+}
+
+int compile_trigger(char *expression, struct trigger *t)
+{
+  int any_opcode = 1;
+  int need_read = 0, need_write = 0;
+  unsigned char opcodes[256] = { 0 };
+
+  t->pc_low = 0;
+  t->pc_high = 0xffff;
+  t->io_low = -1;
+  t->io_high = -1;
+  t->raster_low = 0;
+  t->raster_high = 0xfff;
+
+  char *copy = strdup(expression);
+  char *saveptr = NULL;
+  for (char *term = strtok_r(copy, " ,", &saveptr); term; term = strtok_r(NULL, " ,", &saveptr)) {
+    char *value = strchr(term, '=');
+    if (value)
+      *value++ = 0;
+    int low, high;
+    if (!strcmp(term, "read") && !value)
+      need_read = 1;
+    else if (!strcmp(term, "write") && !value)
+      need_write = 1;
+    else if (!strcmp(term, "pc") && value && !parse_range(value, &low, &high)) {
+      t->pc_low = low;
+      t->pc_high = high;
+    }
+    else if (!strcmp(term, "io") && value && !parse_range(value, &low, &high)) {
+      t->io_low = low;
+      t->io_high = high;
+    }
+    else if (!strcmp(term, "raster") && value && !parse_range(value, &low, &high)) {
+      t->raster_low = low;
+      t->raster_high = high;
+    }
+    else if (!strcmp(term, "op") && value) {
+      // Either a mnemonic, which selects all of its addressing modes, or an opcode
+      int found = 0;
+      for (int i = 0; i < 256; i++)
+        if (opnames[i] && !strcasecmp(opnames[i], value)) {
+          opcodes[i] = 1;
+          found = 1;
+        }
+      if (!found) {
+        if (parse_range(value, &low, &high) || low < 0 || high > 0xff) {
+          fprintf(stderr, "ERROR: Unknown opcode '%s' in trigger '%s'.\n", value, expression);
+          free(copy);
+          return -1;
+        }
+        for (int i = low; i <= high; i++)
+          opcodes[i] = 1;
+      }
+      any_opcode = 0;
+    }
+    else {
+      fprintf(stderr, "ERROR: Could not understand '%s' in trigger '%s'.\n", term, expression);
+      free(copy);
+      return -1;
+    }
+  }
+  free(copy);
+
+  for (int i = 0; i < 256; i++) {
+    t->opcodes[i] = any_opcode || opcodes[i];
+    if (!opnames[i])
+      continue;
+    if (need_write && !opcode_writes(i))
+      t->opcodes[i] = 0;
+    if (need_read && !opcode_reads(i))
+      t->opcodes[i] = 0;
+    if (t->io_low != -1 && strncmp(modes[i], "$nnnn", 5))
+      t->opcodes[i] = 0;
+  }
+  return 0;
+}
+
+void compile_triggers(void)
+{
+  for (int i = 0; i < trigger_expression_count; i++)
+    if (compile_trigger(trigger_expressions[i], &triggers[trigger_count++]))
+      exit(-3);
+}
+
+static inline int trigger_match(const unsigned char *b, int address)
+{
+  for (int i = 0; i < trigger_count; i++) {
+    struct trigger *t = &triggers[i];
+    if (!t->opcodes[b[2]])
+      continue;
+    if (address < t->pc_low || address > t->pc_high)
+      continue;
+    if (current_raster < t->raster_low || current_raster > t->raster_high)
+      continue;
+    if (t->io_low != -1) {
+      int io = b[3] | (b[4] << 8);
+      if (io < t->io_low || io > t->io_high)
+        continue;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+void trigger_instruction(const unsigned char *b)
+{
+  if (skip_instructions) {
+    decode_instruction(b);
+    return;
+  }
+  if (is_raster_record(b)) {
+    current_raster = record_raster(b);
+    if (trigger_remaining)
+      decode_instruction(b);
+    return;
+  }
+
+  if (trigger_match(b, instruction_address)) {
+    if (!trigger_remaining && instruction_count)
+      printf("...\n");
+    // Show the instructions leading up to the match
+    unsigned int first = held_record_count > trigger_before ? held_record_count - trigger_before : 0;
+    for (unsigned int i = first; i < held_record_count; i++) {
+      struct held_record *h = &held_records[i % MAX_TRIGGER_WINDOW];
+      instruction_address = h->address;
+      instruction_count = h->count;
+      decode_instruction(h->b);
+    }
+    held_record_count = 0;
+    trigger_matched = 1;
+    decode_instruction(b);
+    trigger_matched = 0;
+    trigger_remaining = trigger_after + 1;
+  }
+  else if (trigger_remaining)
+    decode_instruction(b);
+  else {
+    if (held_record_count == 2 * MAX_TRIGGER_WINDOW)
+      held_record_count = MAX_TRIGGER_WINDOW;
+    struct held_record *h = &held_records[held_record_count++ % MAX_TRIGGER_WINDOW];
+    memcpy(h->b, b, 8);
+    h->address = instruction_address;
+    h->count = instruction_count;
+    instruction_address = next_instruction_address(b, instruction_address);
+    instruction_count++;
+    return;
+  }
+  trigger_remaining--;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Bus access statistics
+   ----------------------------------------------------------------------------------------------------------
+
+   In bus access mode, each trace record is a fastio bus cycle.  Reads and writes are counted per IO
+   register, along with the gap between successive accesses to the same register, measured in trace
+   records.  A table of the busiest registers is shown for each frame, if the trace contains frame
+   markers, or otherwise every BUS_REPORT_INTERVAL records, and for the whole trace at the end.
+   Accesses before the first frame marker are shown on their own, rather than as part of frame 1.
+
+   The fastio address space is 20 bits, but only a few pages of it are ever used, so register
+   statistics are kept in 4KB pages that are allocated when first touched.
+*/
+
+#define BUS_REPORT_INTERVAL (1 << 20)
+#define BUS_TOP_REGISTERS 16
+#define BUS_PAGE_BITS 12
+
+int bus_access_mode = 0;
+int bus_statistics = 0;
+
+struct io_gaps {
+  unsigned long long count, total, min;
+};
+
+struct io_register {
+  unsigned long long reads, writes;
+  unsigned int interval_reads, interval_writes;
+  unsigned long long last_access;
+  struct io_gaps gaps, interval_gaps;
+};
+
+struct io_register *io_pages[1 << (20 - BUS_PAGE_BITS)] = { NULL };
+
+unsigned long long bus_records = 0;
+unsigned long long bus_interval_start = 0;
+unsigned int bus_frames = 0;
+
+// Registers accessed in the current interval, so that reporting and resetting
+// only has to look at those
+int *bus_touched = NULL;
+int bus_touched_count = 0;
+int bus_touched_size = 0;
+
+struct io_register *io_register(int addr)
+{
+  struct io_register **page = &io_pages[addr >> BUS_PAGE_BITS];
+  if (!*page) {
+    *page = calloc(1 << BUS_PAGE_BITS, sizeof(struct io_register));
+    if (!*page) {
+      perror("calloc()");
+      exit(-1);
+    }
+  }
+  return &(*page)[addr & ((1 << BUS_PAGE_BITS) - 1)];
+}
+
+struct io_register_total {
+  int addr;
+  unsigned long long reads, writes;
+  struct io_gaps gaps;
+};
+
+int compare_io_register_totals(const void *a, const void *b)
+{
+  const struct io_register_total *ra = a, *rb = b;
+  unsigned long long ta = ra->reads + ra->writes, tb = rb->reads + rb->writes;
+  return ta < tb ? 1 : ta > tb ? -1 : ra->addr - rb->addr;
+}
+
+void report_bus_table(struct io_register_total *totals, int count, unsigned long long records)
+{
+  unsigned long long reads = 0, writes = 0;
+  for (int i = 0; i < count; i++) {
+    reads += totals[i].reads;
+    writes += totals[i].writes;
+  }
+  qsort(totals, count, sizeof(struct io_register_total), compare_io_register_totals);
+
+  printf("%lld records: %lld reads, %lld writes, %d registers\n", records, reads, writes, count);
+  printf("  register      reads     writes  share  mean gap   min gap\n");
+  for (int i = 0; i < count && i < BUS_TOP_REGISTERS; i++) {
+    struct io_gaps *g = &totals[i].gaps;
+    printf("  $%05X  %10lld %10lld %5.1f%% %9lld %9lld\n", totals[i].addr, totals[i].reads, totals[i].writes,
+        (totals[i].reads + totals[i].writes) * 100.0 / (reads + writes), g->count ? g->total / g->count : 0,
+        g->count ? g->min : 0);
+  }
+  printf("\n");
+}
+
+void report_bus_interval(void)
+{
+  struct io_register_total *totals = malloc((bus_touched_count + 1) * sizeof(struct io_register_total));
+  if (!totals) {
+    perror("malloc()");
+    exit(-1);
+  }
+  for (int i = 0; i < bus_touched_count; i++) {
+    struct io_register *r = io_register(bus_touched[i]);
+    totals[i].addr = bus_touched[i];
+    totals[i].reads = r->interval_reads;
+    totals[i].writes = r->interval_writes;
+    totals[i].gaps = r->interval_gaps;
+    r->interval_reads = 0;
+    r->interval_writes = 0;
+    r->interval_gaps = (struct io_gaps) { 0, 0, 0 };
+  }
+  if (bus_frames)
+    printf("Frame %d, ", bus_frames);
+  else
+    printf("Records %lld - %lld, ", bus_interval_start, bus_records - 1);
+  report_bus_table(totals, bus_touched_count, bus_records - bus_interval_start);
+  fflush(stdout);
+  free(totals);
+
+  bus_touched_count = 0;
+  bus_interval_start = bus_records;
+}
+
+void report_bus_totals(void)
+{
+  if (bus_records > bus_interval_start)
+    report_bus_interval();
+
+  int count = 0, size = 1024;
+  struct io_register_total *totals = malloc(size * sizeof(struct io_register_total));
+  if (!totals) {
+    perror("malloc()");
+    exit(-1);
+  }
+  for (int page = 0; page < (1 << (20 - BUS_PAGE_BITS)); page++) {
+    if (!io_pages[page])
+      continue;
+    for (int i = 0; i < (1 << BUS_PAGE_BITS); i++) {
+      struct io_register *r = &io_pages[page][i];
+      if (!(r->reads + r->writes))
+        continue;
+      if (count == size) {
+        size *= 2;
+        totals = realloc(totals, size * sizeof(struct io_register_total));
+        if (!totals) {
+          perror("realloc()");
+          exit(-1);
+        }
+      }
+      totals[count].addr = (page << BUS_PAGE_BITS) + i;
+      totals[count].reads = r->reads;
+      totals[count].writes = r->writes;
+      totals[count].gaps = r->gaps;
+      count++;
+    }
+  }
+  printf("Whole trace, ");
+  report_bus_table(totals, count, bus_records);
+  free(totals);
+}
+
+void add_io_gap(struct io_gaps *g, unsigned long long gap)
+{
+  if (!g->count || gap < g->min)
+    g->min = gap;
+  g->total += gap;
+  g->count++;
+}
+
+void busaccess_statistics(const unsigned char *b)
+{
+  // Frame markers have the same layout in both kinds of trace
+  if (is_frame_record(b)) {
+    if (bus_frames || bus_records > bus_interval_start)
+      report_bus_interval();
+    bus_frames++;
+    return;
+  }
+
+  unsigned long long now = bus_records++;
+  int fastio_write = b[6] & 0x80;
+  int fastio_read = b[6] & 0x40;
+  if (fastio_write || fastio_read) {
+    int fastio_addr = b[4] + (b[5] << 8) + ((b[6] & 0xf) << 16);
+    struct io_register *r = io_register(fastio_addr);
+    if (!(r->interval_reads + r->interval_writes)) {
+      if (bus_touched_count == bus_touched_size) {
+        bus_touched_size = bus_touched_size ? bus_touched_size * 2 : 1024;
+        bus_touched = realloc(bus_touched, bus_touched_size * sizeof(int));
+        if (!bus_touched) {
+          perror("realloc()");
+          exit(-1);
+        }
+      }
+      bus_touched[bus_touched_count++] = fastio_addr;
+    }
+    if (r->reads + r->writes) {
+      unsigned long long gap = now - r->last_access;
+      add_io_gap(&r->gaps, gap);
+      add_io_gap(&r->interval_gaps, gap);
+    }
+    r->last_access = now;
+    if (fastio_write) {
+      r->writes++;
+      r->interval_writes++;
+    }
+    else {
+      r->reads++;
+      r->interval_reads++;
+    }
   }
-  if (num == source_file_count) {
-    FILE *f = fopen(file, "r");
-    if (!f)
+
+  if (!bus_frames && bus_records - bus_interval_start == BUS_REPORT_INTERVAL)
+    report_bus_interval();
+}
+
+// Offset of the first trace record in a captured packet, including the
+// Ethernet header
+#define TRACE_OFFSET (0x48 + 14)
+#define TRACE_PACKET_SIZE 2132
+
+void process_packet(const unsigned char *packet, int caplen)
+{
+  if (caplen != TRACE_PACKET_SIZE)
+    return;
+
+  if (!bus_access_mode) {
+    for (int offset = TRACE_OFFSET; offset + 8 <= caplen; offset += 8) {
+      if (instruction_frequency) {
+        if (!is_raster_record(&packet[offset])) {
+          instruction_counts[packet[offset + 2]]++;
+          num_instructions++;
+          if (!(num_instructions & 0xffff)) {
+            report_instruction_frequencies();
+          }
+        }
+      }
+      else if (profile_file)
+        profile_instruction(&packet[offset]);
+      else if (trigger_count)
+        trigger_instruction(&packet[offset]);
+      else
+        decode_instruction(&packet[offset]);
+    }
+  }
+  else {
+    for (int offset = TRACE_OFFSET; offset + 8 <= caplen; offset += 8) {
+      if (bus_statistics)
+        busaccess_statistics(&packet[offset]);
+      else
+        decode_busaccess(&packet[offset]);
+    }
+  }
+}
+
+int packet_instruction_count(const unsigned char *packet)
+{
+  int count = 0;
+  for (int offset = TRACE_OFFSET; offset + 8 <= TRACE_PACKET_SIZE; offset += 8)
+    if (!is_raster_record(&packet[offset]))
+      count++;
+  return count;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Offline decoding of saved pcap captures
+   ----------------------------------------------------------------------------------------------------------
+
+   The capture is mapped rather than read, and a first pass builds a sparse index, recording the
+   file offset and instruction number of every CAPTURE_INDEX_INTERVAL'th trace packet, and the
+   number of the first instruction of each new frame.  Any instruction or frame can then be found by a binary
+   search of the index, and a short scan from there.  Pages that have been decoded are released
+   as we go, so that multi-gigabyte captures are processed in constant memory.
+*/
+
+#define CAPTURE_INDEX_INTERVAL 1024
+// Release pages of the capture behind us in chunks of this size
+#define CAPTURE_RELEASE_CHUNK (64 << 20)
+
+struct capture {
+  unsigned char *data;
+  unsigned long long size;
+  unsigned long long offset;
+  unsigned long long released;
+  int swapped;
+};
+
+struct capture_index_entry {
+  unsigned long long offset;
+  unsigned long long instructions;
+};
+
+struct capture_index_entry *capture_index = NULL;
+unsigned int capture_index_count = 0;
+unsigned long long capture_packets = 0;
+unsigned long long capture_instructions = 0;
+
+// Number of the first instruction of each frame
+unsigned long long *frame_instructions = NULL;
+unsigned int frame_count = 0;
+
+static inline unsigned int capture_u32(struct capture *c, unsigned long long offset)
+{
+  unsigned int v;
+  memcpy(&v, &c->data[offset], 4);
+  return c->swapped ? __builtin_bswap32(v) : v;
+}
+
+int capture_open(struct capture *c, char *filename)
+{
+  bzero(c, sizeof(struct capture));
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open '%s' for reading.\n", filename);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < 24) {
+    fprintf(stderr, "'%s' is too short to be a pcap file.\n", filename);
+    close(fd);
+    return -1;
+  }
+  c->size = st.st_size;
+  c->data = mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (c->data == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(c->data, c->size, MADV_SEQUENTIAL);
+
+  unsigned int magic;
+  memcpy(&magic, c->data, 4);
+  if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+    c->swapped = 1;
+  else if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+    fprintf(stderr, "'%s' is not a pcap file.\n", filename);
+    munmap(c->data, c->size);
+    return -1;
+  }
+  c->offset = 24;
+  return 0;
+}
+
+void capture_seek(struct capture *c, unsigned long long offset)
+{
+  c->offset = offset;
+  c->released = offset & ~(unsigned long long)(CAPTURE_RELEASE_CHUNK - 1);
+}
+
+// Returns the next trace packet of the capture, or NULL at the end.
+// *record_offset is set to the file offset of the packet's pcap record.
+const unsigned char *capture_next(struct capture *c, unsigned long long *record_offset)
+{
+  while (c->offset + 16 <= c->size) {
+    unsigned int caplen = capture_u32(c, c->offset + 8);
+    if (c->offset + 16 + caplen > c->size)
       return NULL;
-    char l[1024];
-    int line_count = 0;
-    l[0] = 0;
-    fgets(l, 1024, f);
-    while (l[0]) {
-      if (line_count == MAX_LINES)
+    const unsigned char *p = &c->data[c->offset + 16];
+    if (record_offset)
+      *record_offset = c->offset;
+    c->offset += 16 + caplen;
+
+    if (c->offset - c->released >= 2 * CAPTURE_RELEASE_CHUNK) {
+      madvise(c->data + c->released, CAPTURE_RELEASE_CHUNK, MADV_DONTNEED);
+      c->released += CAPTURE_RELEASE_CHUNK;
+    }
+
+    if (caplen == TRACE_PACKET_SIZE)
+      return p;
+  }
+  return NULL;
+}
+
+int capture_build_index(struct capture *c)
+{
+  unsigned int index_size = 0;
+  unsigned int frames_size = 0;
+  const unsigned char *p;
+  unsigned long long offset;
+
+  while ((p = capture_next(c, &offset))) {
+    if (!(capture_packets % CAPTURE_INDEX_INTERVAL)) {
+      if (capture_index_count == index_size) {
+        index_size = index_size ? index_size * 2 : 1024;
+        capture_index = realloc(capture_index, index_size * sizeof(struct capture_index_entry));
+        if (!capture_index) {
+          perror("realloc()");
+          return -1;
+        }
+      }
+      capture_index[capture_index_count].offset = offset;
+      capture_index[capture_index_count].instructions = capture_instructions;
+      capture_index_count++;
+    }
+    for (int o = TRACE_OFFSET; o + 8 <= TRACE_PACKET_SIZE; o += 8) {
+      if (!is_raster_record(&p[o]))
+        capture_instructions++;
+      else if (is_frame_record(&p[o])) {
+        if (frame_count == frames_size) {
+          frames_size = frames_size ? frames_size * 2 : 1024;
+          frame_instructions = realloc(frame_instructions, frames_size * sizeof(unsigned long long));
+          if (!frame_instructions) {
+            perror("realloc()");
+            return -1;
+          }
+        }
+        frame_instructions[frame_count++] = capture_instructions;
+      }
+    }
+    capture_packets++;
+  }
+  capture_seek(c, 24);
+  return 0;
+}
+
+// Position the capture so that decoding starts at instruction n.  Decoding
+// actually begins at the instruction before, so that the address of
+// instruction n is known.
+void capture_seek_instruction(struct capture *c, unsigned long long n)
+{
+  unsigned long long prime = n ? n - 1 : 0;
+  unsigned int lo = 0, hi = capture_index_count;
+  while (hi - lo > 1) {
+    unsigned int mid = (lo + hi) / 2;
+    if (capture_index[mid].instructions <= prime)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  capture_seek(c, capture_index[lo].offset);
+  unsigned long long instructions = capture_index[lo].instructions;
+  while (1) {
+    unsigned long long offset = c->offset;
+    const unsigned char *p = capture_next(c, NULL);
+    if (!p)
+      break;
+    int count = packet_instruction_count(p);
+    if (instructions + count > prime) {
+      capture_seek(c, offset);
+      break;
+    }
+    instructions += count;
+  }
+  instruction_count = instructions;
+  skip_instructions = n - instructions;
+}
+
+int decode_capture(char *filename, long long first_instruction, long long first_frame)
+{
+  struct capture c;
+  if (capture_open(&c, filename))
+    return -1;
+  if (capture_build_index(&c))
+    return -1;
+  fprintf(stderr, "Capture contains %lld trace packets, %lld instructions and %d frames.\n", capture_packets,
+      capture_instructions, frame_count);
+
+  if (first_frame >= 0) {
+    if (first_frame >= frame_count) {
+      fprintf(stderr, "ERROR: Capture only contains %d frames.\n", frame_count);
+      return -1;
+    }
+    first_instruction = frame_instructions[first_frame];
+  }
+  if (first_instruction > 0) {
+    if (first_instruction >= capture_instructions) {
+      fprintf(stderr, "ERROR: Capture only contains %lld instructions.\n", capture_instructions);
+      return -1;
+    }
+    capture_seek_instruction(&c, first_instruction);
+  }
+
+  const unsigned char *p;
+  while ((p = capture_next(&c, NULL)))
+    process_packet(p, TRACE_PACKET_SIZE);
+
+  munmap(c.data, c.size);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Live capture
+   ----------------------------------------------------------------------------------------------------------
+
+   Capture runs on its own thread, and only copies trace packets into a single producer, single consumer
+   ring.  Formatting the trace is much slower than capturing it, and if it were done in the capture loop,
+   the socket buffer would overflow and packets would be lost without anyone knowing.  The capture
+   thread only ever writes capture_ring_head, and the formatter only ever writes capture_ring_tail, so
+   no locks are needed.  If the ring fills, packets are dropped and counted, rather than blocking capture.
+*/
+
+#define CAPTURE_RING_SLOTS 4096
+#define CAPTURE_BUFFER_SIZE (32 << 20)
+
+struct captured_packet {
+  struct pcap_pkthdr hdr;
+  unsigned char data[TRACE_PACKET_SIZE];
+};
+
+struct captured_packet capture_ring[CAPTURE_RING_SLOTS];
+unsigned int capture_ring_head = 0;
+unsigned int capture_ring_tail = 0;
+unsigned long long packets_captured = 0;
+unsigned long long packets_dropped = 0;
+
+pcap_t *descr = NULL;
+pcap_dumper_t *dumper = NULL;
+pthread_t captureThread;
+int capture_joined = 0;
+volatile sig_atomic_t stop_capture = 0;
+
+void capture_packet(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *packet)
+{
+  if (hdr->caplen != TRACE_PACKET_SIZE)
+    return;
+  packets_captured++;
+  unsigned int head = capture_ring_head;
+  if (head - __atomic_load_n(&capture_ring_tail, __ATOMIC_ACQUIRE) >= CAPTURE_RING_SLOTS) {
+    packets_dropped++;
+    return;
+  }
+  struct captured_packet *p = &capture_ring[head % CAPTURE_RING_SLOTS];
+  p->hdr = *hdr;
+  memcpy(p->data, packet, TRACE_PACKET_SIZE);
+  __atomic_store_n(&capture_ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void *interface_capture(void *arg)
+{
+  while (!stop_capture) {
+    if (pcap_dispatch(descr, -1, capture_packet, NULL) < 0 && !stop_capture) {
+      fprintf(stderr, "pcap_dispatch() failed due to [%s]\n", pcap_geterr(descr));
+      stop_capture = 1;
+    }
+  }
+  return NULL;
+}
+
+int interface_open(char *dev)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+
+  descr = pcap_create(dev, errbuf);
+  if (!descr) {
+    printf("pcap_create() failed due to [%s]\n", errbuf);
+    return -1;
+  }
+  pcap_set_snaplen(descr, 8192);
+  pcap_set_promisc(descr, 1);
+  pcap_set_timeout(descr, 10);
+  pcap_set_buffer_size(descr, CAPTURE_BUFFER_SIZE);
+  if (pcap_activate(descr) < 0) {
+    printf("pcap_activate() failed due to [%s]\n", pcap_geterr(descr));
+    pcap_close(descr);
+    return -1;
+  }
+
+  struct bpf_program fp;
+  char filter[64];
+  snprintf(filter, 64, "len == %d", TRACE_PACKET_SIZE);
+  if (pcap_compile(descr, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(descr, &fp) == -1)
+    printf("Could not set capture filter: %s\n", pcap_geterr(descr));
+  return 0;
+}
+
+void interface_close(void)
+{
+  if (!descr)
+    return;
+  stop_capture = 1;
+  if (!capture_joined)
+    pthread_join(captureThread, NULL);
+  if (dumper)
+    pcap_dump_close(dumper);
+  fflush(stdout);
+
+  struct pcap_stat ps;
+  fprintf(stderr, "Captured %lld trace packets, %lld dropped because the decoder could not keep up.\n",
+      packets_captured, packets_dropped);
+  if (!pcap_stats(descr, &ps))
+    fprintf(stderr, "%u packets dropped by the kernel, %u by the interface.\n", ps.ps_drop, ps.ps_ifdrop);
+  pcap_close(descr);
+  descr = NULL;
+}
+
+void stop_signal(int sig)
+{
+  stop_capture = 1;
+}
+
+// Decode (or with -w, save) captured packets until interrupted
+void decode_live(void)
+{
+  atexit(interface_close);
+  signal(SIGINT, stop_signal);
+  signal(SIGTERM, stop_signal);
+  pthread_create(&captureThread, NULL, interface_capture, NULL);
+
+  // Once stopped, wait for the capture thread, and then finish the packets
+  // that are still in the ring, so that none that were counted as captured
+  // are lost
+  int draining = 0;
+  while (1) {
+    if (stop_capture && !draining) {
+      pthread_join(captureThread, NULL);
+      capture_joined = 1;
+      draining = 1;
+    }
+    unsigned int tail = capture_ring_tail;
+    if (tail == __atomic_load_n(&capture_ring_head, __ATOMIC_ACQUIRE)) {
+      if (draining)
         break;
-      // Trim CRLF etc
-      while (l[0] && (l[strlen(l) - 1] < ' '))
-        l[strlen(l) - 1] = 0;
-      // Store line
-      source_files[num].lines[line_count++] = strdup(l);
-      source_files[num].line_count = line_count;
-      l[0] = 0;
-      fgets(l, 1024, f);
-    }
-    source_files[num].name = strdup(file);
-    source_file_count++;
-  }
-  if (num == source_file_count)
-    return NULL;
-  if (source_files[num].line_count < line)
-    return NULL;
-  return source_files[num].lines[line];
+      usleep(1000);
+      continue;
+    }
+    struct captured_packet *p = &capture_ring[tail % CAPTURE_RING_SLOTS];
+    if (dumper)
+      pcap_dump((unsigned char *)dumper, &p->hdr, p->data);
+    else
+      process_packet(p->data, p->hdr.caplen);
+    __atomic_store_n(&capture_ring_tail, tail + 1, __ATOMIC_RELEASE);
+  }
 }
 
 int record_address_annotation(int addr, char *source, int line)
@@ -451,26 +1668,26 @@ int record_address_annotation(int addr, char *source, int line)
   if (addr < 0 || addr > 0xffff)
     return -1;
 
-  char *source_line = find_source_line(source, line);
-  char annotation[8192];
-  int source_offset = 0;
-  for (int i = 0; source[i]; i++)
-    if (source[i] == '/')
-      source_offset = i + 1;
-  if (source_line) {
-    while (source_line[0] == '\t' || source_line[0] == ' ')
-      source_line++;
-    snprintf(annotation, 8192, "%s:%d: %s", &source[source_offset], line, source_line);
+  int num = find_source_file(source);
+  if (num == -1)
+    return -1;
+  int len;
+  const char *source_line = find_source_line(&source_files[num], line, &len);
+  if (source_line)
+    record_symbol(addr, source_line, len);
+
+  if (!(annotation_count & 0xfff)) {
+    annotation_list = realloc(annotation_list, (annotation_count + 0x1000) * sizeof(struct annotation));
+    if (!annotation_list) {
+      perror("realloc()");
+      exit(-1);
+    }
   }
-  else
-    snprintf(annotation, 8192, "%s:%d", &source[source_offset], line);
-
-  //  printf("  %s\n",annotation);
-
-  struct annotation *a = calloc(sizeof(struct annotation), 1);
-  a->text = strdup(annotation);
+  struct annotation *a = &annotation_list[annotation_count];
+  a->source = num;
+  a->line = line;
   a->next = annotations[addr];
-  annotations[addr] = a;
+  annotations[addr] = annotation_count++;
   return 0;
 }
 
@@ -508,8 +1725,29 @@ int read_annotation_file(char *an)
 
 int usage(void)
 {
-  fprintf(stderr, "usage: ethermon [-F] [-n num instructions] [-m match string] <network interface> [.list, .map or other "
-                  "supported memory annotation files]\n");
+  fprintf(stderr, "usage: ethermon [-F] [-i | -I] [-n num instructions] [-m match string] [-t trigger [-B before] [-A after]]\n"
+                  "                [-p collapsed stack file]\n"
+                  "                <network interface> [.list, .map or other supported memory annotation files]\n");
+  fprintf(stderr, "       ethermon -w <capture.pcap> <network interface>\n");
+  fprintf(stderr, "       ethermon [-F] [-i | -I] [-n num instructions] [-m match string] [-t trigger [-B before] [-A after]]\n"
+                  "                [-p collapsed stack file]\n"
+                  "                [-s first instruction | -S first frame] -r <capture.pcap> [annotation files]\n");
+  fprintf(stderr, "If -r is specified, a saved pcap capture is decoded instead of a live interface, optionally starting\n"
+                  "from the given instruction (-s) or frame (-S).\n");
+  fprintf(stderr, "If -w is specified, the raw trace packets are saved to <capture.pcap> without being decoded, for\n"
+                  "later use with -r.\n");
+  fprintf(stderr, "If -p is specified, a profile of the instruction stream is shown every %d instructions, with\n"
+                  "routines named from the labels in the annotation files, and the call stacks are written to\n"
+                  "<collapsed stack file> in the format used by flamegraph.pl.\n",
+      PROFILE_REPORT_INTERVAL);
+  fprintf(stderr, "If -t is specified, only instructions around those matching the trigger are displayed: -B before\n"
+                  "(default 16) and -A after (default 16).  A trigger is a list of conditions that must all hold:\n"
+                  "  pc=<address or range>    op=<mnemonic or opcode>    io=<absolute operand address or range>\n"
+                  "  read    write    raster=<VIC-IV raster line or range>\n"
+                  "e.g. -t 'op=sta io=$d020-$d021 raster=$40-$48'.  -t can be given more than once.\n");
+  fprintf(stderr, "If -I is specified, the trace is decoded as fastio bus accesses instead of instructions.  With -i,\n"
+                  "a table of the busiest IO registers is shown for each frame instead, with access counts and the\n"
+                  "mean and minimum number of trace records between accesses.\n");
   fprintf(stderr, "If -m is specified, then no instructions are displayed until <match string> appears in the output.\n");
   fprintf(stderr, "If -F is specified, the instruction stream is collected for a single frame of video display.\n");
   exit(-3);
@@ -518,19 +1756,57 @@ int usage(void)
 int main(int argc, char **argv)
 {
   char *dev;
-  char errbuf[PCAP_ERRBUF_SIZE];
-  pcap_t *descr;
-  //    struct bpf_program fp;        /* to hold compiled program */
-  bpf_u_int32 pMask; /* subnet mask */
-  bpf_u_int32 pNet;  /* ip address*/
-  pcap_if_t *alldevs;
 
   for (int i = 0; i < 0x10000; i++)
-    annotations[i] = NULL;
+    annotations[i] = -1;
+
+  char *capture_file = NULL;
+  char *dump_file = NULL;
+  long long first_instruction = 0;
+  long long first_frame = -1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "bfFm:n:")) != -1) {
+  while ((opt = getopt(argc, argv, "A:bB:fFiIm:n:p:r:s:S:t:w:")) != -1) {
     switch (opt) {
+    case 'p':
+      profile_file = optarg;
+      break;
+    case 'r':
+      capture_file = optarg;
+      break;
+    case 's':
+      first_instruction = strtoll(optarg, NULL, 0);
+      break;
+    case 'S':
+      first_frame = strtoll(optarg, NULL, 0);
+      break;
+    case 'w':
+      dump_file = optarg;
+      break;
+    case 't':
+      if (trigger_expression_count == MAX_TRIGGERS) {
+        fprintf(stderr, "ERROR: At most %d triggers can be given.\n", MAX_TRIGGERS);
+        exit(-1);
+      }
+      trigger_expressions[trigger_expression_count++] = optarg;
+      break;
+    case 'A':
+      trigger_after = atoi(optarg);
+      break;
+    case 'B':
+      trigger_before = atoi(optarg);
+      if (trigger_before < 0 || trigger_before > MAX_TRIGGER_WINDOW) {
+        fprintf(stderr, "ERROR: -B must be between 0 and %d.\n", MAX_TRIGGER_WINDOW);
+        exit(-1);
+      }
+      break;
+    case 'i':
+      bus_access_mode = 1;
+      bus_statistics = 1;
+      break;
+    case 'I':
+      bus_access_mode = 1;
+      break;
     case 'f':
       instruction_frequency = 1;
       num_instructions = 0;
@@ -557,17 +1833,19 @@ int main(int argc, char **argv)
     }
   }
 
-  if (optind >= argc)
+  if (optind >= argc && !capture_file)
     usage();
 
-  if (argv[optind])
-    dev = argv[optind];
+  if (capture_file)
+    dev = NULL;
+  else if (argv[optind])
+    dev = argv[optind++];
   else {
     fprintf(stderr, "You must specify the interface to listen on.\n");
     exit(-1);
   }
 
-  for (int i = optind + 1; i < argc; i++)
+  for (int i = optind; i < argc; i++)
     read_annotation_file(argv[i]);
 
   int i;
@@ -589,78 +1867,42 @@ int main(int argc, char **argv)
     }
   }
 
-  // Prepare a list of all the devices
-  if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-    fprintf(stderr, "Error in pcap_findalldevs: %s\n", errbuf);
-    exit(1);
+  compile_triggers();
+  if (profile_file)
+    profile_init();
+
+  if (capture_file) {
+    if (decode_capture(capture_file, first_instruction, first_frame))
+      return -1;
+    if (profile_file)
+      report_profile();
+    if (bus_statistics)
+      report_bus_totals();
+    return 0;
   }
 
-  // If something was not provided
-  // return error.
-  if (dev == NULL) {
-    printf("\n[%s]\n", errbuf);
+  if (interface_open(dev))
     return -1;
+  if (dump_file) {
+    dumper = pcap_dump_open(descr, dump_file);
+    if (!dumper) {
+      fprintf(stderr, "Could not open '%s' for writing: %s\n", dump_file, pcap_geterr(descr));
+      return -1;
+    }
   }
-
-  // fetch the network address and network mask
-  pcap_lookupnet(dev, &pNet, &pMask, errbuf);
-
-  // Now, open device for sniffing with big snaplen and
-  // promiscuous mode enabled.
-  descr = pcap_open_live(dev, 8192, 1, 10, errbuf);
-  if (descr == NULL) {
-    printf("pcap_open_live() failed due to [%s]\n", errbuf);
-    return -1;
+  else if (!isatty(fileno(stdout))) {
+    // Writing to a file or pipe, so don't flush every line
+    setvbuf(stdout, NULL, _IOFBF, 1 << 20);
   }
 
   printf("Started.\n");
   fflush(stdout);
 
-  int bit52set = 0;
-
-  while (1) {
-
-    struct pcap_pkthdr hdr;
-    hdr.caplen = 0;
-    const unsigned char *packet = pcap_next(descr, &hdr);
-    if (packet) {
-      if (hdr.caplen == 2132) {
-        bit52set = 0;
-        for (int offset = 0x48 + 14; (offset + 6) < hdr.caplen; offset += 8) {
-          if (packet[offset + 6] & 0x10) {
-#if 0
-	      printf(">>> Bit52 set at offset $%X+6\n",offset-14);
-	      for(int j=0;j<8;j++) printf(" %02X",packet[offset+j]);
-	      printf("\n");
-#endif
-            bit52set = 1;
-            break;
-          }
-        }
-        // For now only support instruction decode
-        if (1 || bit52set) {
-          for (int offset = 0x48 + 14; offset < hdr.caplen; offset += 8) {
-            if (instruction_frequency) {
-              if ((packet[offset + 0] & packet[offset + 1] & packet[offset + 2]) != 0xff) {
-                instruction_counts[packet[offset + 2]]++;
-                num_instructions++;
-                if (!(num_instructions & 0xffff)) {
-                  report_instruction_frequencies();
-                }
-              }
-            }
-            else
-              decode_instruction(&packet[offset]);
-          }
-        }
-        else {
-          for (int offset = 0x48 + 14; offset < hdr.caplen; offset += 8) {
-            decode_busaccess(&packet[offset]);
-          }
-        }
-      }
-    }
-  }
+  decode_live();
+  if (profile_file)
+    report_profile();
+  if (bus_statistics)
+    report_bus_totals();
   printf("Exiting.\n");
 
   return 0;
@@ -87,6 +87,20 @@ static libusb_device_handle *usbhandle = NULL;
 static struct libusb_context *usb_context;
 static libusb_device **device_list;
 #endif
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+/*
+ * Writes are submitted asynchronously, with up to WRITE_TRANSFERS in flight
+ * at once, so that the FTDI always has the next block of MPSSE commands
+ * queued while it clocks out the current one.  Transfers on one endpoint
+ * complete in order, so everything written has arrived once they have all
+ * completed, which must be waited for before reading any results.
+ */
+#define WRITE_TRANSFERS 8
+static struct libusb_transfer *write_transfers[WRITE_TRANSFERS];
+static uint8_t write_buffers[WRITE_TRANSFERS][USB_CHUNKSIZE];
+static int write_next;
+static int writes_in_flight;
+#endif
 static USB_INFO usbinfo_array[MAX_USB_DEVICECOUNT];
 static int usbinfo_array_index;
 static uint8_t usbreadbuffer[USB_CHUNKSIZE];
@@ -122,32 +136,70 @@ void memdump(const uint8_t *p, int len, char *title)
 }
 
 #ifndef USE_LIBFTDI
+#ifndef NO_LIBUSB
+static void LIBUSB_CALL write_complete(struct libusb_transfer *transfer)
+{
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+    fprintf(stderr, "fpgajtag: usb bulk write failed: status %d req size %d act %d\n", transfer->status,
+        transfer->length, transfer->actual_length);
+    exit(-1);
+  }
+  writes_in_flight--;
+}
+
+/* Wait until no more than max writes are still in flight */
+static void wait_writes(int max)
+{
+  while (writes_in_flight > max) {
+    int ret = libusb_handle_events(usb_context);
+    if (ret < 0) {
+      fprintf(stderr, "fpgajtag: usb event handling failed: ret %d\n", ret);
+      exit(-1);
+    }
+  }
+}
+#endif
+
 static int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
 {
-  int actual_length = -1;
-  int ret = -1;
   if (logging)
     formatwrite(1, buf, size, "WRITE");
 #ifndef NO_LIBUSB
-  ret = libusb_bulk_transfer(usbhandle, ENDPOINT_IN, (unsigned char *)buf, size, &actual_length, USB_TIMEOUT);
+  if (size > USB_CHUNKSIZE) {
+    fprintf(stderr, "fpgajtag: usb bulk write of %d bytes is too big\n", size);
+    exit(-1);
+  }
+  /* Transfers complete in order, so once a slot is free, it is this one */
+  wait_writes(WRITE_TRANSFERS - 1);
+  int i = write_next;
+  write_next = (write_next + 1) % WRITE_TRANSFERS;
+  if (!write_transfers[i] && !(write_transfers[i] = libusb_alloc_transfer(0))) {
+    fprintf(stderr, "fpgajtag: unable to allocate usb transfer\n");
+    exit(-1);
+  }
+  memcpy(write_buffers[i], buf, size);
+  libusb_fill_bulk_transfer(
+      write_transfers[i], usbhandle, ENDPOINT_IN, write_buffers[i], size, write_complete, NULL, USB_TIMEOUT);
+  int ret = libusb_submit_transfer(write_transfers[i]);
+  if (ret < 0) {
+    fprintf(stderr, "fpgajtag: usb bulk write failed: ret %d req size %d\n", ret, size);
+    exit(-1);
+  }
+  writes_in_flight++;
 #ifdef USE_LOGGING
   dump_bytes(log_depth + 2, __FUNCTION__, buf, size);
 #endif
 #endif
-  if (ret < 0) {
-    fprintf(stderr, "fpgajtag: usb bulk write failed: ret %d req size %d act %d\n", ret, size, actual_length);
-    exit(-1);
-  }
-  struct timeval timeout;
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 100;
-  select(0, NULL, NULL, NULL, &timeout);
-  return actual_length;
+  return size;
 }
 static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
 {
   int actual_length = 1;
   int count = 0, ret = -1;
+#ifndef NO_LIBUSB
+  /* The FTDI can't answer commands that it hasn't been sent yet */
+  wait_writes(0);
+#endif
   do {
     count++;
 #ifndef NO_LIBUSB
@@ -475,6 +527,11 @@ void fpgausb_close(void)
     ftdi_deinit(global_ftdi); /* flush out logfile */
 #else
 #ifndef NO_LIBUSB
+  wait_writes(0);
+  for (int i = 0; i < WRITE_TRANSFERS; i++) {
+    libusb_free_transfer(write_transfers[i]);
+    write_transfers[i] = NULL;
+  }
   if (usbhandle)
     libusb_close(usbhandle);
   usbhandle = NULL;
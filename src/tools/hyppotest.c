@@ -5,11 +5,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 int do_screen_shot_ascii(FILE *f);
 int do_screen_shot(char *filename);
+void forget_golden_image(char *filename);
+int compare_screen(char *filename, int tolerance, int allowed_pixels, bool expect_match);
 void get_video_state(void);
 
 #define MEM_WRITE16(CPU, ADDR, VALUE)                                                                                       \
@@ -75,6 +82,10 @@ struct termination_conditions {
 
 struct cpu {
   unsigned int instruction_count;
+  // Totals for the whole test, which unlike instruction_count are not
+  // reset each time a routine is called
+  unsigned long long total_instructions;
+  unsigned long long cycles;
   struct regs regs;
   struct termination_conditions term;
   bool stack_overflow;
@@ -164,6 +175,7 @@ typedef struct instruction_log {
 #define MAX_LOG_LENGTH (32 * 1024 * 1024)
 instruction_log *cpulog[MAX_LOG_LENGTH];
 int cpulog_len = 0;
+int cpulog_peak = 0;
 
 #define INFINITE_LOOP_THRESHOLD 65536
 
@@ -1476,6 +1488,319 @@ unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
   return addr;
 }
 
+/* ----------------------------------------------------------------------------------------------------------
+   CIA timer and VIC-IV raster interrupt sources
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+// Emulated time is taken from cpu.cycles, assuming a 40.5MHz CPU
+#define CYCLES_PER_CIA_TICK 41 // ~1MHz CIA phi2 clock
+#define PAL_CYCLES_PER_RASTER 2592 // 64usec VIC-II raster line
+#define PAL_RASTERS_PER_FRAME 312
+#define NTSC_CYCLES_PER_RASTER 2574 // 63.56usec
+#define NTSC_RASTERS_PER_FRAME 263
+
+#define NEVER (~0ULL)
+
+// Each interrupt source has a fixed slot in the event table, so scheduling
+// and cancelling an event is O(1), and the per-instruction cost is a single
+// comparison against the earliest due event.
+enum { EVENT_CIA1_TA, EVENT_CIA1_TB, EVENT_CIA2_TA, EVENT_CIA2_TB, EVENT_RASTER, EVENT_COUNT };
+unsigned long long event_due[EVENT_COUNT];
+unsigned long long next_event_cycle = NEVER;
+
+struct cia {
+  // Offset of the CIA's registers in ffdram[]
+  unsigned int base;
+  // Event slot for timer A; timer B uses the next one
+  int event;
+  unsigned short latch[2];
+  // Counter value when the timer was last stopped, or when stopped timers
+  // were loaded
+  unsigned short counter[2];
+  // Control registers, kept here as well as in ffdram[] so that a write can
+  // see how the timer was counting beforehand
+  unsigned char control[2];
+  unsigned char icr_mask;
+  unsigned char icr_flags;
+};
+struct cia cia1 = { 0x3c00, EVENT_CIA1_TA };
+struct cia cia2 = { 0x3d00, EVENT_CIA2_TA };
+
+bool interrupt_sources_enabled = false;
+unsigned char vic_irq_flags = 0;
+bool irq_line = false;
+bool nmi_line = false;
+bool nmi_pending = false;
+
+void schedule_event(int event, unsigned long long due)
+{
+  event_due[event] = due;
+  if (due < next_event_cycle)
+    next_event_cycle = due;
+}
+
+void cancel_event(int event)
+{
+  // next_event_cycle is left alone: a stale value only costs one pass
+  // through run_due_events() that finds nothing to do.
+  event_due[event] = NEVER;
+}
+
+void update_interrupt_lines(void)
+{
+  irq_line = (cia1.icr_flags & cia1.icr_mask) || (vic_irq_flags & ffdram[0x301a] & 0x0f);
+  bool nmi = cia2.icr_flags & cia2.icr_mask;
+  // NMI is edge triggered
+  if (nmi && !nmi_line)
+    nmi_pending = true;
+  nmi_line = nmi;
+}
+
+bool cia_timer_running(struct cia *c, int timer)
+{
+  return c->control[timer] & 0x01;
+}
+
+bool cia_timer_cascaded(struct cia *c, int timer)
+{
+  // Timer B can count timer A underflows instead of phi2 clocks
+  return timer && (c->control[timer] & 0x60) == 0x40;
+}
+
+unsigned short cia_timer_value(struct cia *c, int timer)
+{
+  int event = c->event + timer;
+  if (!cia_timer_running(c, timer) || cia_timer_cascaded(c, timer) || event_due[event] == NEVER)
+    return c->counter[timer];
+  if (event_due[event] <= cpu.cycles)
+    return 0;
+  return (event_due[event] - cpu.cycles - 1) / CYCLES_PER_CIA_TICK;
+}
+
+void cia_timer_start(struct cia *c, int timer, unsigned long long from)
+{
+  if (cia_timer_cascaded(c, timer))
+    cancel_event(c->event + timer);
+  else
+    schedule_event(c->event + timer, from + (c->counter[timer] + 1ULL) * CYCLES_PER_CIA_TICK);
+}
+
+void cia_timer_underflow(struct cia *c, int timer, unsigned long long when)
+{
+  c->icr_flags |= 1 << timer;
+  c->counter[timer] = c->latch[timer];
+  if (c->control[timer] & 0x08) {
+    // One-shot mode stops the timer
+    c->control[timer] &= 0xfe;
+    ffdram[c->base + 0x0e + timer] = c->control[timer];
+    cancel_event(c->event + timer);
+  }
+  else
+    cia_timer_start(c, timer, when);
+
+  if (!timer && cia_timer_running(c, 1) && cia_timer_cascaded(c, 1)) {
+    if (!c->counter[1]--)
+      cia_timer_underflow(c, 1, when);
+  }
+  update_interrupt_lines();
+}
+
+// $D06F bit 7 selects NTSC, as in the render code's is_pal_mode
+unsigned int cycles_per_raster(void)
+{
+  return (ffdram[0x306f] & 0x80) ? NTSC_CYCLES_PER_RASTER : PAL_CYCLES_PER_RASTER;
+}
+
+unsigned int rasters_per_frame(void)
+{
+  return (ffdram[0x306f] & 0x80) ? NTSC_RASTERS_PER_FRAME : PAL_RASTERS_PER_FRAME;
+}
+
+unsigned long long cycles_per_frame(void)
+{
+  return (unsigned long long)cycles_per_raster() * rasters_per_frame();
+}
+
+void raster_schedule(void)
+{
+  unsigned int compare = ffdram[0x3012] + ((ffdram[0x3011] & 0x80) << 1);
+  if (compare >= rasters_per_frame()) {
+    cancel_event(EVENT_RASTER);
+    return;
+  }
+  unsigned long long frame_start = cpu.cycles - cpu.cycles % cycles_per_frame();
+  unsigned long long due = frame_start + compare * cycles_per_raster();
+  if (due <= cpu.cycles)
+    due += cycles_per_frame();
+  schedule_event(EVENT_RASTER, due);
+}
+
+unsigned int current_raster(void)
+{
+  return (cpu.cycles / cycles_per_raster()) % rasters_per_frame();
+}
+
+void run_due_events(void)
+{
+  unsigned long long now = cpu.cycles;
+  next_event_cycle = NEVER;
+  for (int i = 0; i < EVENT_COUNT; i++) {
+    unsigned long long due = event_due[i];
+    if (due <= now) {
+      event_due[i] = NEVER;
+      switch (i) {
+      case EVENT_CIA1_TA:
+      case EVENT_CIA1_TB:
+        cia_timer_underflow(&cia1, i - EVENT_CIA1_TA, due);
+        break;
+      case EVENT_CIA2_TA:
+      case EVENT_CIA2_TB:
+        cia_timer_underflow(&cia2, i - EVENT_CIA2_TA, due);
+        break;
+      case EVENT_RASTER:
+        vic_irq_flags |= 0x01;
+        schedule_event(EVENT_RASTER, due + cycles_per_frame());
+        update_interrupt_lines();
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < EVENT_COUNT; i++)
+    if (event_due[i] < next_event_cycle)
+      next_event_cycle = event_due[i];
+}
+
+void interrupt_sources_reset(bool enable)
+{
+  interrupt_sources_enabled = enable;
+  for (int i = 0; i < EVENT_COUNT; i++)
+    event_due[i] = NEVER;
+  next_event_cycle = NEVER;
+  struct cia *cias[2] = { &cia1, &cia2 };
+  for (int i = 0; i < 2; i++) {
+    cias[i]->latch[0] = cias[i]->latch[1] = 0xffff;
+    cias[i]->counter[0] = cias[i]->counter[1] = 0xffff;
+    cias[i]->icr_mask = 0;
+    cias[i]->icr_flags = 0;
+    cias[i]->control[0] = cias[i]->control[1] = 0;
+    ffdram[cias[i]->base + 0x0e] = 0;
+    ffdram[cias[i]->base + 0x0f] = 0;
+  }
+  vic_irq_flags = 0;
+  irq_line = false;
+  nmi_line = false;
+  nmi_pending = false;
+  if (enable)
+    raster_schedule();
+}
+
+void cia_write(struct cia *c, unsigned int reg, unsigned char value)
+{
+  int timer = (reg >> 1) & 1;
+  switch (reg) {
+  case 0x04:
+  case 0x06:
+    c->latch[timer] = (c->latch[timer] & 0xff00) | value;
+    break;
+  case 0x05:
+  case 0x07:
+    c->latch[timer] = (c->latch[timer] & 0x00ff) | (value << 8);
+    // Writing the high byte of a stopped timer also loads the counter
+    if (!cia_timer_running(c, timer))
+      c->counter[timer] = c->latch[timer];
+    break;
+  case 0x0d:
+    if (value & 0x80)
+      c->icr_mask |= value & 0x1f;
+    else
+      c->icr_mask &= ~value;
+    update_interrupt_lines();
+    break;
+  case 0x0e:
+  case 0x0f:
+    timer = reg - 0x0e;
+    // Work out the current count before the control register changes
+    // how it is counted
+    c->counter[timer] = cia_timer_value(c, timer);
+    // Force load is a strobe, and does not stick
+    c->control[timer] = value & 0xef;
+    ffdram[c->base + reg] = c->control[timer];
+    if (value & 0x10)
+      c->counter[timer] = c->latch[timer];
+    if (value & 0x01)
+      cia_timer_start(c, timer, cpu.cycles);
+    else
+      cancel_event(c->event + timer);
+    break;
+  }
+}
+
+bool cia_read(struct cia *c, unsigned int reg, unsigned char *value)
+{
+  switch (reg) {
+  case 0x04:
+  case 0x06:
+    *value = cia_timer_value(c, reg == 0x06) & 0xff;
+    return true;
+  case 0x05:
+  case 0x07:
+    *value = cia_timer_value(c, reg == 0x07) >> 8;
+    return true;
+  case 0x0d:
+    // Reading the ICR acknowledges all pending interrupts
+    *value = c->icr_flags | ((c->icr_flags & c->icr_mask) ? 0x80 : 0x00);
+    c->icr_flags = 0;
+    update_interrupt_lines();
+    return true;
+  }
+  return false;
+}
+
+void interrupt_source_write(unsigned int addr, unsigned char value)
+{
+  switch (addr) {
+  case 0xffd3011: // Raster compare bit 8
+  case 0xffd3012: // Raster compare bits 0-7
+  case 0xffd306f: // PAL/NTSC changes the frame length
+    raster_schedule();
+    break;
+  case 0xffd3019: // Acknowledge VIC interrupts
+    vic_irq_flags &= ~value;
+    update_interrupt_lines();
+    break;
+  case 0xffd301a: // VIC interrupt mask
+    update_interrupt_lines();
+    break;
+  default:
+    if (addr >= 0xffd3c00 && addr < 0xffd3c10)
+      cia_write(&cia1, addr & 0x0f, value);
+    else if (addr >= 0xffd3d00 && addr < 0xffd3d10)
+      cia_write(&cia2, addr & 0x0f, value);
+  }
+}
+
+bool interrupt_source_read(unsigned int addr, unsigned char *value)
+{
+  switch (addr) {
+  case 0xffd3011:
+    *value = (ffdram[0x3011] & 0x7f) | ((current_raster() & 0x100) >> 1);
+    return true;
+  case 0xffd3012:
+    *value = current_raster() & 0xff;
+    return true;
+  case 0xffd3019:
+    *value = 0x70 | vic_irq_flags | ((vic_irq_flags & ffdram[0x301a] & 0x0f) ? 0x80 : 0x00);
+    return true;
+  default:
+    if (addr >= 0xffd3c00 && addr < 0xffd3c10)
+      return cia_read(&cia1, addr & 0x0f, value);
+    else if (addr >= 0xffd3d00 && addr < 0xffd3d10)
+      return cia_read(&cia2, addr & 0x0f, value);
+  }
+  return false;
+}
+
 unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
 {
   if (addr >= 0xfff8000 && addr < 0xfffc000) {
@@ -1492,6 +1817,9 @@ unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
   }
   else if ((addr & 0xfff0000) == 0xffd0000) {
     // $FFDxxxx IO space
+    unsigned char value;
+    if (interrupt_sources_enabled && interrupt_source_read(addr, &value))
+      return value;
     return ffdram[addr - 0xffd0000];
   }
   // Otherwise unmapped RAM
@@ -2249,6 +2577,8 @@ int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
       do_dma(cpu, 1, dma_addr);
       break;
     }
+    if (interrupt_sources_enabled)
+      interrupt_source_write(addr, value);
     if (!cpu->regs.in_hyper) {
       if (addr >= 0xffd3640 && addr <= 0xffd367f) {
         // Enter hypervisor
@@ -4005,8 +4335,29 @@ bool execute_instruction(struct cpu *cpu, struct instruction_log *log)
   return true;
 }
 
+bool take_interrupt(unsigned short vector)
+{
+  if (!stack_push(&cpu, cpu.regs.pc >> 8) || !stack_push(&cpu, cpu.regs.pc & 0xff)
+      || !stack_push(&cpu, cpu.regs.flags & ~FLAG_B))
+    return false;
+  cpu.regs.flag_i = true;
+  cpu.regs.pc = read_memory(&cpu, vector) + (read_memory(&cpu, vector + 1) << 8);
+  return true;
+}
+
 bool cpu_step(FILE *f)
 {
+  // Interrupts are only taken between instructions, and never in the
+  // hypervisor or straight after a MAP instruction
+  if ((nmi_pending || (irq_line && !cpu.regs.flag_i)) && !cpu.regs.in_hyper && !cpu.regs.map_irq_inhibit) {
+    unsigned short vector = nmi_pending ? 0xfffa : 0xfffe;
+    nmi_pending = false;
+    if (!take_interrupt(vector)) {
+      cpu.term.error = true;
+      return false;
+    }
+  }
+
   if (breakpoints[cpu.regs.pc]) {
     fprintf(logfile, "INFO: Breakpoint at %s ($%04X) triggered.\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
     cpu.term.done = true;
@@ -4019,11 +4370,15 @@ bool cpu_step(FILE *f)
   log->len = 0; // byte count of instruction
   log->count = 1;
   log->dup = 0;
+  log->pops = 0;
 
   // Add instruction to the log
   cpu.instruction_count = cpulog_len;
   cpulog[cpulog_len++] = log;
 
+  if (cpulog_len > cpulog_peak)
+    cpulog_peak = cpulog_len;
+
   if (!execute_instruction(&cpu, log)) {
     cpu.term.error = true;
     fprintf(f, "ERROR: Exception occurred executing instruction at %s\n       Aborted.\n", describe_address(cpu.regs.pc));
@@ -4031,6 +4386,13 @@ bool cpu_step(FILE *f)
     return false;
   }
 
+  cpu.total_instructions++;
+  // We don't model exact 45GS02 timing, so approximate it as one cycle per
+  // instruction byte fetched, plus one for the operation itself
+  cpu.cycles += log->len + 1;
+  if (cpu.cycles >= next_event_cycle)
+    run_due_events();
+
   // Ignore stack underflows/overflows if execution is complete, so that
   // terminal RTS doesn't cause a stack underflow error
   if (cpu.term.done)
@@ -4320,6 +4682,8 @@ void machine_init(struct cpu *cpu)
 
   bzero(breakpoints, sizeof(breakpoints));
 
+  interrupt_sources_reset(false);
+
   bzero(&cpu_expected, sizeof(struct cpu));
   cpu_expected.regs.flags = FLAG_E | FLAG_I;
 
@@ -4360,6 +4724,171 @@ void machine_init(struct cpu *cpu)
   bzero(lastataddr, sizeof(lastataddr));
 }
 
+/* ----------------------------------------------------------------------------------------------------------
+   Machine-readable test results
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+// Results are accumulated in memory while the tests run, and only written
+// out once at exit, so that recording them costs nothing during a test.
+typedef struct test_result {
+  char *name;
+  bool passed;
+  unsigned long long instructions;
+  unsigned long long cycles;
+  double wall_time;
+  size_t peak_trace_bytes;
+} test_result;
+test_result *test_results = NULL;
+int test_result_count = 0;
+int test_result_alloc = 0;
+
+char *results_script = NULL;
+char *junit_filename = NULL;
+char *json_filename = NULL;
+
+struct timespec test_start_time;
+
+double elapsed_since(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void record_test_result(struct cpu *cpu)
+{
+  if (!junit_filename && !json_filename)
+    return;
+  if (test_result_count >= test_result_alloc) {
+    test_result_alloc = test_result_alloc ? test_result_alloc * 2 : 64;
+    test_results = realloc(test_results, test_result_alloc * sizeof(test_result));
+    if (!test_results) {
+      perror("realloc()");
+      exit(-2);
+    }
+  }
+  test_result *r = &test_results[test_result_count++];
+  r->name = strdup(test_name);
+  r->passed = !cpu->term.error;
+  r->instructions = cpu->total_instructions;
+  r->cycles = cpu->cycles;
+  r->wall_time = elapsed_since(&test_start_time);
+  r->peak_trace_bytes = (size_t)cpulog_peak * (sizeof(instruction_log) + sizeof(instruction_log *));
+}
+
+void fput_xml_escaped(FILE *f, const char *s)
+{
+  for (; *s; s++) {
+    switch (*s) {
+    case '<':
+      fputs("&lt;", f);
+      break;
+    case '>':
+      fputs("&gt;", f);
+      break;
+    case '&':
+      fputs("&amp;", f);
+      break;
+    case '"':
+      fputs("&quot;", f);
+      break;
+    default:
+      fputc(*s, f);
+    }
+  }
+}
+
+void fput_json_escaped(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+FILE *open_results_file(char *filename)
+{
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not write test results to '%s'\n", filename);
+    return NULL;
+  }
+  setvbuf(f, NULL, _IOFBF, 256 * 1024);
+  return f;
+}
+
+void write_junit_results(char *filename)
+{
+  FILE *f = open_results_file(filename);
+  if (!f)
+    return;
+
+  double total_time = 0;
+  for (int i = 0; i < test_result_count; i++)
+    total_time += test_results[i].wall_time;
+
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(f, "<testsuites>\n");
+  fprintf(f, "  <testsuite name=\"");
+  fput_xml_escaped(f, results_script);
+  fprintf(f, "\" tests=\"%d\" failures=\"%d\" time=\"%.6f\">\n", test_result_count, test_fails, total_time);
+  for (int i = 0; i < test_result_count; i++) {
+    test_result *r = &test_results[i];
+    fprintf(f, "    <testcase classname=\"");
+    fput_xml_escaped(f, results_script);
+    fprintf(f, "\" name=\"");
+    fput_xml_escaped(f, r->name);
+    fprintf(f, "\" time=\"%.6f\">\n", r->wall_time);
+    fprintf(f, "      <properties>\n");
+    fprintf(f, "        <property name=\"instructions\" value=\"%llu\"/>\n", r->instructions);
+    fprintf(f, "        <property name=\"cycles\" value=\"%llu\"/>\n", r->cycles);
+    fprintf(f, "        <property name=\"peak_trace_bytes\" value=\"%zu\"/>\n", r->peak_trace_bytes);
+    fprintf(f, "      </properties>\n");
+    if (!r->passed)
+      fprintf(f, "      <failure message=\"Test failed\"/>\n");
+    fprintf(f, "    </testcase>\n");
+  }
+  fprintf(f, "  </testsuite>\n");
+  fprintf(f, "</testsuites>\n");
+  fclose(f);
+}
+
+void write_json_results(char *filename)
+{
+  FILE *f = open_results_file(filename);
+  if (!f)
+    return;
+
+  fprintf(f, "{\n  \"script\": ");
+  fput_json_escaped(f, results_script);
+  fprintf(f, ",\n  \"passes\": %d,\n  \"fails\": %d,\n  \"tests\": [", test_passes, test_fails);
+  for (int i = 0; i < test_result_count; i++) {
+    test_result *r = &test_results[i];
+    fprintf(f, "%s\n    { \"name\": ", i ? "," : "");
+    fput_json_escaped(f, r->name);
+    fprintf(f,
+        ", \"passed\": %s, \"instructions\": %llu, \"cycles\": %llu, \"wall_time\": %.6f, \"peak_trace_bytes\": %zu }",
+        r->passed ? "true" : "false", r->instructions, r->cycles, r->wall_time, r->peak_trace_bytes);
+  }
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+}
+
+void write_test_results(void)
+{
+  if (junit_filename)
+    write_junit_results(junit_filename);
+  if (json_filename)
+    write_json_results(json_filename);
+}
+
 void test_init(struct cpu *cpu)
 {
 
@@ -4381,6 +4910,9 @@ void test_init(struct cpu *cpu)
 
   bzero(breakpoints, sizeof(breakpoints));
 
+  cpulog_peak = 0;
+  clock_gettime(CLOCK_MONOTONIC, &test_start_time);
+
   // Log to temporary file, so that we can rename it to PASS.* or FAIL.*
   // after.
   unlink(TESTLOGFILE);
@@ -4401,6 +4933,13 @@ void test_init(struct cpu *cpu)
     safe_name[strlen(test_name)] = 0;
   }
 
+  // Remove any stale screen difference image from a previous run
+  {
+    char diff_name[8192];
+    snprintf(diff_name, 8192, "DIFF.%s.png", safe_name);
+    unlink(diff_name);
+  }
+
   // Show starting of test
   printf("[    ] %s", test_name);
 }
@@ -4439,6 +4978,8 @@ void test_conclude(struct cpu *cpu)
     printf("\r[PASS] %s\n", test_name);
   }
 
+  record_test_result(cpu);
+
   if (logfile != stderr) {
     fclose(logfile);
     system(cmd);
@@ -4447,37 +4988,159 @@ void test_conclude(struct cpu *cpu)
   logfile = stderr;
 }
 
+// Files loaded by tests are mapped once, and kept for later tests, so that
+// reloading the same image for each test costs only the copy into memory.
+typedef struct mapped_file {
+  char *path;
+  struct timespec mtime;
+  size_t size;
+  unsigned char *data;
+  struct mapped_file *next;
+} mapped_file;
+mapped_file *mapped_files = NULL;
+
+void unmap_file(mapped_file *m)
+{
+  if (m->size)
+    munmap(m->data, m->size);
+  m->data = NULL;
+  m->size = 0;
+}
+
+mapped_file *map_file(char *filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+
+  mapped_file *m;
+  for (m = mapped_files; m; m = m->next)
+    if (!strcmp(m->path, filename))
+      break;
+  if (m) {
+    if (m->size == st.st_size && m->mtime.tv_sec == st.st_mtim.tv_sec && m->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      close(fd);
+      return m;
+    }
+    // File has changed since we last loaded it
+    unmap_file(m);
+  }
+  else {
+    m = calloc(1, sizeof(mapped_file));
+    if (!m) {
+      perror("calloc()");
+      close(fd);
+      return NULL;
+    }
+    m->path = strdup(filename);
+    m->next = mapped_files;
+    mapped_files = m;
+  }
+
+  m->mtime = st.st_mtim;
+  if (st.st_size) {
+    m->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m->data == MAP_FAILED) {
+      m->data = NULL;
+      close(fd);
+      return NULL;
+    }
+  }
+  m->size = st.st_size;
+  close(fd);
+  return m;
+}
+
+void forget_file(char *filename)
+{
+  for (mapped_file **p = &mapped_files; *p; p = &(*p)->next) {
+    if (!strcmp((*p)->path, filename)) {
+      mapped_file *m = *p;
+      *p = m->next;
+      unmap_file(m);
+      free(m->path);
+      free(m);
+      return;
+    }
+  }
+}
+
+void fill_blame(unsigned int *blame, unsigned int count, unsigned int value)
+{
+  for (unsigned int i = 0; i < count; i++)
+    blame[i] = value;
+}
+
+// Copy a block into memory, using bulk copies for plain RAM regions.  IO and
+// anything else goes byte by byte through write_mem28(), so that side-effects
+// and errors behave exactly as for CPU writes.
+int write_region28(struct cpu *cpu, unsigned int addr, unsigned char *data, unsigned int len)
+{
+  while (len) {
+    unsigned int n = 1;
+    if (addr >= 0xfff8000 && addr < 0xfffc000) {
+      unsigned int offset = addr - 0xfff8000;
+      n = HYPPORAM_SIZE - offset;
+      if (n > len)
+        n = len;
+      memcpy(&hypporam[offset], data, n);
+      fill_blame(&hypporam_blame[offset], n, cpu->instruction_count);
+    }
+    else if (addr > 1 && addr < CHIPRAM_SIZE) {
+      // $0000 and $0001 are the CPU port, which write_mem28() handles
+      n = CHIPRAM_SIZE - addr;
+      if (n > len)
+        n = len;
+      memcpy(&chipram[addr], data, n);
+      fill_blame(&chipram_blame[addr], n, cpu->instruction_count);
+    }
+    else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
+      unsigned int offset = addr - 0xff80000;
+      n = COLOURRAM_SIZE - offset;
+      if (n > len)
+        n = len;
+      memcpy(&colourram[offset], data, n);
+      fill_blame(&colourram_blame[offset], n, cpu->instruction_count);
+    }
+    else
+      write_mem28(cpu, addr, data[0]);
+    addr += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
 int load_hyppo(char *filename)
 {
-  FILE *f = fopen(filename, "rb");
-  if (!f) {
+  mapped_file *m = map_file(filename);
+  if (!m) {
     fprintf(logfile, "ERROR: Could not read HICKUP file from '%s'\n", filename);
     return -1;
   }
-  int b = fread(hypporam_expected, 1, HYPPORAM_SIZE, f);
-  if (b != HYPPORAM_SIZE) {
-    fprintf(logfile, "ERROR: Read only %d of %d bytes from HICKUP file.\n", b, HYPPORAM_SIZE);
+  if (m->size < HYPPORAM_SIZE) {
+    fprintf(logfile, "ERROR: Read only %d of %d bytes from HICKUP file.\n", (int)m->size, HYPPORAM_SIZE);
     return -1;
   }
-  fclose(f);
+  write_region28(&cpu, 0xfff8000, m->data, HYPPORAM_SIZE);
+  bcopy(hypporam, hypporam_expected, HYPPORAM_SIZE);
   return 0;
 }
 
-unsigned char buffer[8192 * 1024];
 int load_file(char *filename, unsigned int location)
 {
-  FILE *f = fopen(filename, "rb");
-  if (!f) {
+  mapped_file *m = map_file(filename);
+  if (!m) {
     fprintf(logfile, "ERROR: Could not read binary file from '%s'\n", filename);
     return -1;
   }
-  int b = fread(buffer, 1, 8192 * 1024, f);
-  fprintf(logfile, "NOTE: Loading %d bytes at $%07x from %s\n", b, location, filename);
-  for (int i = 0; i < b; i++) {
-    write_mem28(&cpu, i + location, buffer[i]);
-  }
-
-  fclose(f);
+  fprintf(logfile, "NOTE: Loading %d bytes at $%07x from %s\n", (int)m->size, location, filename);
+  write_region28(&cpu, location, m->data, m->size);
   return 0;
 }
 
@@ -4708,6 +5371,7 @@ void assemble_with_acme(FILE *f, struct cpu *cpu, unsigned short pc)
   //
   // Load the ACME output files
   load_file(bin_file_name, pc);
+  forget_file(bin_file_name);
   load_symbols(sym_file_name, 0);
 cleanup:
   if (buffer_file != NULL)
@@ -4722,12 +5386,33 @@ cleanup:
   free(sym_file_name);
 }
 
+void usage(void)
+{
+  fprintf(stderr, "usage: hyppotest [-x <junit.xml>] [-j <results.json>] <test script> [<test>]\n");
+  fprintf(stderr, "  -x - Write test results in JUnit XML format to the named file.\n");
+  fprintf(stderr, "  -j - Write test results in JSON format to the named file.\n");
+  exit(-2);
+}
+
 int main(int argc, char **argv)
 {
-  if (argc < 2 || argc > 3) {
-    fprintf(stderr, "usage: hyppotest <test script> [<test>]\n");
-    exit(-2);
+  int opt;
+  while ((opt = getopt(argc, argv, "j:x:")) != -1) {
+    switch (opt) {
+    case 'j':
+      json_filename = optarg;
+      break;
+    case 'x':
+      junit_filename = optarg;
+      break;
+    default:
+      usage();
+    }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 2 || argc > 3)
+    usage();
 
   // Setup for anonymous tests, if user doesn't supply any test directives
   machine_init(&cpu);
@@ -4740,6 +5425,9 @@ int main(int argc, char **argv)
     exit(-2);
   }
   const char *test_target = (argc == 3 ? argv[2] : NULL);
+  results_script = argv[1];
+  if (junit_filename || json_filename)
+    atexit(write_test_results);
   if (test_target) {
     printf("INFO: Only running test \"%s\"\n", test_target);
   }
@@ -4796,6 +5484,14 @@ int main(int argc, char **argv)
       cpu.term.log_dma = true;
       fprintf(logfile, "NOTE: DMA jobs will be reported\n");
     }
+    else if (!strncasecmp(line_ptr, "emulate interrupts off", strlen("emulate interrupts off"))) {
+      interrupt_sources_reset(false);
+      fprintf(logfile, "NOTE: CIA timers and raster interrupts will not be emulated\n");
+    }
+    else if (!strncasecmp(line_ptr, "emulate interrupts", strlen("emulate interrupts"))) {
+      interrupt_sources_reset(true);
+      fprintf(logfile, "NOTE: CIA timers and raster interrupts will be emulated\n");
+    }
     else if (!strncasecmp(line_ptr, "log on failure", strlen("log on failure"))) {
       // Dump all instructions on test failure
       log_on_failure = true;
@@ -4968,6 +5664,30 @@ int main(int argc, char **argv)
         cpu.term.error = true;
       }
     }
+    else if (sscanf(line_ptr, "screenshot %s", location) == 1) {
+      if (do_screen_shot(location))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen matches %s within %u allowing %u", location, &first, &last) == 3) {
+      if (compare_screen(location, first, last, true))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen matches %s within %u", location, &first) == 2) {
+      if (compare_screen(location, first, 0, true))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen matches %s", location) == 1) {
+      if (compare_screen(location, 0, 0, true))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen differs from %s within %u", location, &first) == 2) {
+      if (compare_screen(location, first, 0, false))
+        cpu.term.error = true;
+    }
+    else if (sscanf(line_ptr, "expect screen differs from %s", location) == 1) {
+      if (compare_screen(location, 0, 0, false))
+        cpu.term.error = true;
+    }
     else if (sscanf(line_ptr, "expect flag %s is %s", location, value) == 2) {
       bool v;
       if (strcasecmp(value, "set") == 0) {
@@ -5245,9 +5965,14 @@ unsigned char mega65_rgb(int colour, int rgb)
 }
 
 png_structp png_ptr = NULL;
-png_bytep png_rows[576];
 int is_pal_mode = 0;
 
+// The screen is rendered straight into this RGB buffer, so that it can be
+// compared against golden images without a PNG encode/decode round-trip
+#define SCREEN_PIXELS_X 720
+#define SCREEN_PIXELS_Y_MAX 576
+unsigned char screen_rgb[SCREEN_PIXELS_Y_MAX][SCREEN_PIXELS_X * 3];
+
 int min_y = 0;
 int max_y = 999;
 
@@ -5266,9 +5991,9 @@ int set_pixel(int x, int y, int r, int g, int b)
   }
 
   //  printf("Setting pixel at %d,%d to #%02x%02x%02x\n",x,y,b,g,r);
-  ((unsigned char *)png_rows[y])[x * 3 + 0] = r;
-  ((unsigned char *)png_rows[y])[x * 3 + 1] = g;
-  ((unsigned char *)png_rows[y])[x * 3 + 2] = b;
+  screen_rgb[y][x * 3 + 0] = r;
+  screen_rgb[y][x * 3 + 1] = g;
+  screen_rgb[y][x * 3 + 2] = b;
 
   return 0;
 }
@@ -5691,8 +6416,6 @@ void get_video_state(void)
 
 void paint_screen_shot(void)
 {
-  printf("Painting rasters %d -- %d\n", min_y, max_y);
-
   // Now render the text display
   int y_position = chargen_y;
   for (int cy = 0; cy < screen_rows; cy++) {
@@ -5978,89 +6701,272 @@ void paint_screen_shot(void)
   return;
 }
 
-int do_screen_shot(char *filename)
+void render_screen(void)
 {
-
   get_video_state();
 
-  //  printf("Got video state.\n");
+  int height = is_pal_mode ? 576 : 480;
 
-  //  printf("Got ASCII screenshot.\n");
+  // Set all pixels to border colour
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < SCREEN_PIXELS_X; x++) {
+      screen_rgb[y][x * 3 + 0] = mega65_rgb(border_colour, 0);
+      screen_rgb[y][x * 3 + 1] = mega65_rgb(border_colour, 1);
+      screen_rgb[y][x * 3 + 2] = mega65_rgb(border_colour, 2);
+    }
+  }
+
+  // Start by drawing the non-border area
+  for (int y = top_border_y; y < bottom_border_y && (y < height); y++) {
+    for (int x = left_border; x < right_border; x++) {
+      screen_rgb[y][x * 3 + 0] = mega65_rgb(background_colour, 0);
+      screen_rgb[y][x * 3 + 1] = mega65_rgb(background_colour, 1);
+      screen_rgb[y][x * 3 + 2] = mega65_rgb(background_colour, 2);
+    }
+  }
+
+  {
+    //     printf("Video mode does not use raster splits. Drawing normally.\n");
+    min_y = 0;
+    max_y = height;
+    paint_screen_shot();
+  }
+}
+
+int do_screen_shot(char *filename)
+{
+
+  render_screen();
 
   FILE *f = NULL;
   f = fopen(filename, "wb");
   if (!f) {
-    fprintf(stderr, "ERROR: Could not open '%s' for writing.\n", filename);
+    fprintf(logfile, "ERROR: Could not open '%s' for writing.\n", filename);
     return -1;
   }
   // printf("Rendering pixel-exact version to %s...\n", filename);
 
   png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!png_ptr) {
-    fprintf(stderr, "ERROR: Could not creat PNG structure.\n");
+    fprintf(logfile, "ERROR: Could not creat PNG structure.\n");
+    fclose(f);
     return -1;
   }
 
   png_infop info_ptr = png_create_info_struct(png_ptr);
   if (!info_ptr) {
-    fprintf(stderr, "ERROR: Could not creat PNG info structure.\n");
+    fprintf(logfile, "ERROR: Could not creat PNG info structure.\n");
+    png_destroy_write_struct(&png_ptr, NULL);
+    fclose(f);
     return -1;
   }
 
   png_init_io(png_ptr, f);
 
   // Set image size based on PAL or NTSC video mode
-  png_set_IHDR(png_ptr, info_ptr, 720, is_pal_mode ? 576 : 480, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+  png_set_IHDR(png_ptr, info_ptr, SCREEN_PIXELS_X, is_pal_mode ? 576 : 480, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
   png_write_info(png_ptr, info_ptr);
 
-  // Allocate frame buffer for image, and set all pixels to the border colour by default
-  // printf("Allocating PNG frame buffer...\n");
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++) {
-    png_rows[y] = (png_bytep)malloc(3 * 720 * sizeof(png_byte));
-    if (!png_rows[y]) {
-      perror("malloc()");
-      return -1;
+  //  printf("Writing out PNG frame buffer...\n");
+  // Write out each row of the PNG
+  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++)
+    png_write_row(png_ptr, screen_rgb[y]);
+
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  fclose(f);
+  // Later comparisons against this file must see the new screen
+  forget_golden_image(filename);
+
+  fprintf(logfile, "INFO: Wrote screen capture to %s\n", filename);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Screen comparison against golden images
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+// Golden images are decoded once, and then kept for all subsequent tests,
+// unless the file changes, as map_file() does for loaded files
+typedef struct golden_image {
+  char *filename;
+  struct timespec mtime;
+  off_t size;
+  unsigned int width;
+  unsigned int height;
+  unsigned char *rgb;
+  struct golden_image *next;
+} golden_image;
+golden_image *golden_images = NULL;
+
+void forget_golden_image(char *filename)
+{
+  for (golden_image **p = &golden_images; *p; p = &(*p)->next) {
+    if (!strcmp((*p)->filename, filename)) {
+      golden_image *g = *p;
+      *p = g->next;
+      free(g->filename);
+      free(g->rgb);
+      free(g);
+      return;
     }
-    // Set all pixels to border colour
-    for (int x = 0; x < 720; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(border_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(border_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(border_colour, 2);
+  }
+}
+
+golden_image *load_golden_image(char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st)) {
+    fprintf(logfile, "ERROR: Could not read golden image '%s': %s\n", filename, strerror(errno));
+    return NULL;
+  }
+  for (golden_image *g = golden_images; g; g = g->next) {
+    if (!strcmp(g->filename, filename)) {
+      if (g->size == st.st_size && g->mtime.tv_sec == st.st_mtim.tv_sec && g->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return g;
+      // File has changed since we last decoded it
+      forget_golden_image(filename);
+      break;
     }
   }
 
-  printf("Rendering screen...\n");
+  png_image image;
+  bzero(&image, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, filename)) {
+    fprintf(logfile, "ERROR: Could not read golden image '%s': %s\n", filename, image.message);
+    return NULL;
+  }
+  image.format = PNG_FORMAT_RGB;
+  unsigned char *rgb = malloc(PNG_IMAGE_SIZE(image));
+  if (!rgb) {
+    perror("malloc()");
+    png_image_free(&image);
+    return NULL;
+  }
+  if (!png_image_finish_read(&image, NULL, rgb, 0, NULL)) {
+    fprintf(logfile, "ERROR: Could not decode golden image '%s': %s\n", filename, image.message);
+    free(rgb);
+    return NULL;
+  }
 
-  // Start by drawing the non-border area
-  for (int y = top_border_y; y < bottom_border_y && (y < (is_pal_mode ? 576 : 480)); y++) {
-    for (int x = left_border; x < right_border; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(background_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(background_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(background_colour, 2);
-    }
+  golden_image *g = malloc(sizeof(golden_image));
+  if (!g) {
+    perror("malloc()");
+    free(rgb);
+    return NULL;
   }
+  g->filename = strdup(filename);
+  g->mtime = st.st_mtim;
+  g->size = st.st_size;
+  g->width = image.width;
+  g->height = image.height;
+  g->rgb = rgb;
+  g->next = golden_images;
+  golden_images = g;
+  return g;
+}
 
-  {
-    //     printf("Video mode does not use raster splits. Drawing normally.\n");
-    min_y = 0;
-    max_y = is_pal_mode ? 576 : 480;
-    paint_screen_shot();
+// Perceptual distance between two pixels, weighting each channel by its
+// contribution to luminance, so that the result is in the range 0 - 255
+static inline int pixel_delta(unsigned char *a, unsigned char *b)
+{
+  return (299 * abs(a[0] - b[0]) + 587 * abs(a[1] - b[1]) + 114 * abs(a[2] - b[2])) / 1000;
+}
+
+int write_diff_image(char *filename, golden_image *g, int tolerance)
+{
+  // Differing pixels are shown in red, over a dimmed grey version of the golden image
+  unsigned char *rgb = malloc(g->width * g->height * 3);
+  if (!rgb) {
+    perror("malloc()");
+    return -1;
+  }
+  for (int y = 0; y < g->height; y++) {
+    for (int x = 0; x < g->width; x++) {
+      unsigned char *want = &g->rgb[(y * g->width + x) * 3];
+      unsigned char *got = &screen_rgb[y][x * 3];
+      unsigned char *out = &rgb[(y * g->width + x) * 3];
+      if (pixel_delta(want, got) > tolerance) {
+        out[0] = 0xff;
+        out[1] = 0x00;
+        out[2] = 0x00;
+      }
+      else {
+        unsigned char grey = (299 * want[0] + 587 * want[1] + 114 * want[2]) / 4000;
+        out[0] = grey;
+        out[1] = grey;
+        out[2] = grey;
+      }
+    }
   }
 
-  //  printf("Writing out PNG frame buffer...\n");
-  // Write out each row of the PNG
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++)
-    png_write_row(png_ptr, png_rows[y]);
+  png_image image;
+  bzero(&image, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  image.width = g->width;
+  image.height = g->height;
+  image.format = PNG_FORMAT_RGB;
+  int result = png_image_write_to_file(&image, filename, 0, rgb, 0, NULL) ? 0 : -1;
+  if (result)
+    fprintf(logfile, "ERROR: Could not write difference image '%s': %s\n", filename, image.message);
+  free(rgb);
+  return result;
+}
 
-  png_write_end(png_ptr, NULL);
+// With expect_match false, the screen must differ, which is mostly for testing the comparison
+// itself: the difference image must still be written, but is then removed, as the test passed.
+int compare_screen(char *filename, int tolerance, int allowed_pixels, bool expect_match)
+{
+  golden_image *g = load_golden_image(filename);
+  if (!g)
+    return -1;
 
-  fclose(f);
+  render_screen();
+
+  int height = is_pal_mode ? 576 : 480;
+  if (g->width != SCREEN_PIXELS_X || g->height != height) {
+    fprintf(logfile, "ERROR: Golden image '%s' is %dx%d, but screen is %dx%d\n", filename, g->width, g->height,
+        SCREEN_PIXELS_X, height);
+    return -1;
+  }
 
-  printf("Wrote screen capture to %s...\n", filename);
-  // start_cpu();
-  // exit(0);
+  int differing = 0;
+  int worst = 0;
+  for (int y = 0; y < height; y++) {
+    unsigned char *want = &g->rgb[y * SCREEN_PIXELS_X * 3];
+    unsigned char *got = screen_rgb[y];
+    // Most rows match exactly, so avoid the per-pixel work for those
+    if (!memcmp(want, got, SCREEN_PIXELS_X * 3))
+      continue;
+    for (int x = 0; x < SCREEN_PIXELS_X * 3; x += 3) {
+      int delta = pixel_delta(&want[x], &got[x]);
+      if (delta > worst)
+        worst = delta;
+      if (delta > tolerance)
+        differing++;
+    }
+  }
 
-  return 0;
+  if (differing > allowed_pixels) {
+    char diff_name[8192];
+    snprintf(diff_name, 8192, "DIFF.%s.png", safe_name);
+    fprintf(logfile, "%s: Screen does not match '%s': %d pixels differ by more than %d (worst = %d)\n",
+        expect_match ? "ERROR" : "INFO", filename, differing, tolerance, worst);
+    if (write_diff_image(diff_name, g, tolerance))
+      return -1;
+    fprintf(logfile, "INFO: Wrote screen difference image to %s\n", diff_name);
+    if (expect_match)
+      return -1;
+    unlink(diff_name);
+    return 0;
+  }
+  fprintf(logfile, "%s: Screen matches '%s' (%d pixels differ, worst = %d)\n", expect_match ? "INFO" : "ERROR",
+      filename, differing, worst);
+  return expect_match ? 0 : -1;
 }
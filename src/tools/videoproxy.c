@@ -22,6 +22,7 @@
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -42,9 +43,18 @@
 #include <signal.h>
 #include <netdb.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <getopt.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
 #include <pcap.h>
 
-int client_sock = -1;
+// Size of the compressed video frames sent by the MEGA65
+#define VIDEO_PACKET_SIZE 2132
 
 int create_listen_socket(int port)
 {
@@ -92,68 +102,798 @@ int accept_incoming(int sock)
   return -1;
 }
 
-int main(int argc, char **argv)
+/* ----------------------------------------------------------------------------------------------------------
+   Recent packet history, shared by all clients
+   ----------------------------------------------------------------------------------------------------------
+
+   Each captured packet is stored once, and each client has its own cursor into the history.  A
+   client that falls more than half the history behind skips ahead to the next packet that starts a
+   new frame, so that it resumes cleanly, and capture and the other clients are never held up.
+*/
+
+#define HISTORY_PACKETS 4096
+
+struct history_slot {
+  // Extra room for the look-ahead of the token scanner
+  unsigned char data[VIDEO_PACKET_SIZE + 4];
+  unsigned char new_frame;
+};
+struct history_slot history[HISTORY_PACKETS];
+// Sequence number of the next packet to be captured
+unsigned long long history_head = 0;
+
+// Length of each token of the video stream, indexed by its first 8 bits.
+// See vncserver.c for the format.
+unsigned char token_len[256];
+
+void init_token_table(void)
 {
-  char *dev;
-  char errbuf[PCAP_ERRBUF_SIZE];
-  pcap_t *descr;
-  //    struct bpf_program fp;        /* to hold compiled program */
-  bpf_u_int32 pMask; /* subnet mask */
-  bpf_u_int32 pNet;  /* ip address*/
-  pcap_if_t *alldevs;
+  for (int b = 0; b < 256; b++) {
+    if (!(b & 0x80))
+      token_len[b] = 1;
+    else if ((b & 0xc0) == 0x80)
+      token_len[b] = 2;
+    else if ((b & 0xf0) != 0xf0)
+      token_len[b] = 4;
+    else if ((b & 0xf8) == 0xf0)
+      token_len[b] = 17;
+    else if ((b & 0xfc) == 0xf8)
+      token_len[b] = 16;
+    else if (b == 0xfe)
+      token_len[b] = 16;
+    else if (b == 0xff)
+      token_len[b] = 1;
+    else
+      token_len[b] = 8;
+  }
+}
 
-  // Prepare a list of all the devices
-  if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-    fprintf(stderr, "Error in pcap_findalldevs: %s\n", errbuf);
-    exit(1);
+// Whether the packet contains a new frame token.  Packets always start on a
+// token boundary, so this can be worked out without any other state.
+int packet_has_new_frame(const unsigned char *p)
+{
+  unsigned int last_start = VIDEO_PACKET_SIZE * 8 - 20;
+  for (unsigned int bitpos = 0x56 * 8; bitpos <= last_start;) {
+    const unsigned char *b = p + (bitpos >> 3);
+    uint32_t bits = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    if (bitpos & 7)
+      bits = (bits << (bitpos & 7)) | (b[4] >> (8 - (bitpos & 7)));
+    if (!(bits & 0x80000000)) {
+      // Skip a run of same colour pixels in one go
+      bitpos += bits ? __builtin_clz(bits) : 32;
+      continue;
+    }
+    if ((bits >> 24) == 0xfc)
+      return 1;
+    bitpos += token_len[bits >> 24];
   }
+  return 0;
+}
 
-  if (argv[1])
-    dev = argv[1];
-  else {
-    fprintf(stderr, "You must specify the interface to listen on.\n");
-    exit(-1);
+void history_add(const unsigned char *packet)
+{
+  struct history_slot *slot = &history[history_head % HISTORY_PACKETS];
+  memcpy(slot->data, packet, VIDEO_PACKET_SIZE);
+  slot->new_frame = packet_has_new_frame(slot->data);
+  history_head++;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   UDP multicast re-broadcast
+   ----------------------------------------------------------------------------------------------------------
+
+   Each captured packet is sent as one datagram, so any number of receivers can watch for the cost
+   of a single stream.  The Ethernet header and unused space before the compressed video data at
+   offset 0x56 is replaced by a 12 byte header:
+
+     "M65V", 32-bit sequence number (network byte order), flags, 3 reserved bytes
+
+   Flag bit 0 is set if the packet contains a new frame token.  Receivers use the sequence
+   numbers to detect lost packets.  The datagrams are larger than a normal Ethernet MTU, and so
+   are sent as IP fragments.  The matching receiver is vncserver --multicast.
+*/
+
+#define MULTICAST_HEADER_SIZE 12
+#define MULTICAST_FLAG_NEW_FRAME 0x01
+#define MULTICAST_BATCH 64
+
+int multicast_sock = -1;
+struct sockaddr_in multicast_addr;
+unsigned long long multicast_cursor = 0;
+unsigned long long multicast_dropped = 0;
+
+int multicast_open(char *spec, int ttl)
+{
+  char group[256];
+  int port = 6565;
+  if (sscanf(spec, "%255[^:]:%d", group, &port) < 1) {
+    fprintf(stderr, "Could not parse multicast group '%s'\n", spec);
+    return -1;
+  }
+
+  bzero(&multicast_addr, sizeof(multicast_addr));
+  multicast_addr.sin_family = AF_INET;
+  multicast_addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, group, &multicast_addr.sin_addr) != 1) {
+    fprintf(stderr, "'%s' is not an IPv4 address\n", group);
+    return -1;
+  }
+
+  multicast_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (multicast_sock == -1) {
+    perror("socket(SOCK_DGRAM)");
+    return -1;
+  }
+  unsigned char t = ttl;
+  setsockopt(multicast_sock, IPPROTO_IP, IP_MULTICAST_TTL, &t, sizeof(t));
+  // Also allows broadcast addresses to be used
+  int on = 1;
+  setsockopt(multicast_sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+  fcntl(multicast_sock, F_SETFL, fcntl(multicast_sock, F_GETFL, NULL) | O_NONBLOCK);
+
+  printf("Sending video to %s:%d\n", group, port);
+  // Start with the next packet captured
+  multicast_cursor = history_head;
+  return 0;
+}
+
+// Send all packets captured since last time, in batches of one system call
+void multicast_send(void)
+{
+  if (multicast_sock == -1)
+    return;
+
+  // Never fall further behind than the history allows
+  if (history_head - multicast_cursor > HISTORY_PACKETS) {
+    multicast_dropped += history_head - HISTORY_PACKETS - multicast_cursor;
+    multicast_cursor = history_head - HISTORY_PACKETS;
+  }
+
+  while (multicast_cursor < history_head) {
+    struct mmsghdr msgs[MULTICAST_BATCH];
+    struct iovec iov[MULTICAST_BATCH][2];
+    unsigned char headers[MULTICAST_BATCH][MULTICAST_HEADER_SIZE];
+    int count = 0;
+
+    for (unsigned long long seq = multicast_cursor; seq < history_head && count < MULTICAST_BATCH; seq++) {
+      struct history_slot *slot = &history[seq % HISTORY_PACKETS];
+      unsigned char *h = headers[count];
+      memcpy(h, "M65V", 4);
+      h[4] = seq >> 24;
+      h[5] = seq >> 16;
+      h[6] = seq >> 8;
+      h[7] = seq;
+      h[8] = slot->new_frame ? MULTICAST_FLAG_NEW_FRAME : 0;
+      h[9] = h[10] = h[11] = 0;
+      iov[count][0].iov_base = h;
+      iov[count][0].iov_len = MULTICAST_HEADER_SIZE;
+      iov[count][1].iov_base = &slot->data[0x56];
+      iov[count][1].iov_len = VIDEO_PACKET_SIZE - 0x56;
+      bzero(&msgs[count], sizeof(struct mmsghdr));
+      msgs[count].msg_hdr.msg_name = &multicast_addr;
+      msgs[count].msg_hdr.msg_namelen = sizeof(multicast_addr);
+      msgs[count].msg_hdr.msg_iov = iov[count];
+      msgs[count].msg_hdr.msg_iovlen = 2;
+      count++;
+    }
+
+    int sent = sendmmsg(multicast_sock, msgs, count, 0);
+    if (sent < 1) {
+      if (sent == -1 && errno == EINTR)
+        continue;
+      // The socket buffer is full: drop what we have rather than stall capture
+      multicast_dropped += count;
+      multicast_cursor += count;
+      if (!(multicast_dropped & (multicast_dropped - 1)))
+        fprintf(stderr, "%lld multicast packets dropped.\n", multicast_dropped);
+      return;
+    }
+    multicast_cursor += sent;
+  }
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Clients
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+#define MAX_CLIENTS 64
+// Send at most this many packets per writev().  Linux allows at most 1024 iovecs per call.
+#define BATCH_PACKETS 1024
+
+struct client {
+  int fd;
+  // Sequence number of the next packet to send
+  unsigned long long cursor;
+  // Number of bytes of that packet already sent.  If non-zero, the packet is
+  // kept in partial[], as its history slot could be overwritten before the
+  // rest of it is sent.
+  int offset;
+  unsigned char partial[VIDEO_PACKET_SIZE];
+  // Waiting for the next new frame packet after falling behind
+  int resync;
+  // Waiting for the socket to become writeable
+  int blocked;
+  unsigned long long packets_skipped;
+};
+struct client clients[MAX_CLIENTS];
+
+int epoll_fd = -1;
+int listen_sock = -1;
+int capture_fd = -1;
+
+void client_close(struct client *c)
+{
+  printf("Client %d disconnected (skipped %lld packets).\n", c->fd, c->packets_skipped);
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+}
+
+void client_set_blocked(struct client *c, int blocked)
+{
+  if (c->blocked == blocked)
+    return;
+  c->blocked = blocked;
+  struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | (blocked ? EPOLLOUT : 0), { .ptr = c } };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_skip(struct client *c)
+{
+  unsigned long long oldest = history_head > HISTORY_PACKETS ? history_head - HISTORY_PACKETS : 0;
+  if (c->cursor < oldest)
+    c->cursor = oldest;
+  c->resync = 1;
+}
+
+// Send as much of the history as the client's socket will take
+void client_send(struct client *c)
+{
+  while (c->fd != -1 && c->cursor < history_head) {
+    int lagging = history_head - c->cursor > HISTORY_PACKETS / 2;
+    if (!c->offset && lagging)
+      client_skip(c);
+    if (c->resync) {
+      unsigned long long from = c->cursor;
+      while (c->cursor < history_head && !history[c->cursor % HISTORY_PACKETS].new_frame)
+        c->cursor++;
+      c->packets_skipped += c->cursor - from;
+      if (c->cursor == history_head)
+        break;
+      c->resync = 0;
+    }
+
+    // A lagging client only finishes the packet that it is part way through,
+    // before skipping ahead, as the packets after it may have been overwritten
+    struct iovec iov[BATCH_PACKETS];
+    int count = 0;
+    int limit = c->offset && lagging ? 1 : BATCH_PACKETS;
+    if (c->offset) {
+      iov[count].iov_base = &c->partial[c->offset];
+      iov[count].iov_len = VIDEO_PACKET_SIZE - c->offset;
+      count++;
+    }
+    for (unsigned long long seq = c->cursor + count; seq < history_head && count < limit; seq++) {
+      iov[count].iov_base = history[seq % HISTORY_PACKETS].data;
+      iov[count].iov_len = VIDEO_PACKET_SIZE;
+      count++;
+    }
+
+    ssize_t r = writev(c->fd, iov, count);
+    if (r == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        client_set_blocked(c, 1);
+        return;
+      }
+      client_close(c);
+      return;
+    }
+
+    // Advance over whole packets sent, and keep a copy of any packet that
+    // was only partly sent, unless partial[] already holds it
+    unsigned long long was = c->cursor;
+    int was_partial = c->offset != 0;
+    r += c->offset;
+    c->cursor += r / VIDEO_PACKET_SIZE;
+    c->offset = r % VIDEO_PACKET_SIZE;
+    if (c->offset && (!was_partial || c->cursor != was))
+      memcpy(c->partial, history[c->cursor % HISTORY_PACKETS].data, VIDEO_PACKET_SIZE);
+  }
+  if (c->fd != -1)
+    client_set_blocked(c, 0);
+}
+
+void clients_accept(void)
+{
+  int sock;
+  while ((sock = accept_incoming(listen_sock)) != -1) {
+    struct client *c = NULL;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+      if (clients[i].fd == -1) {
+        c = &clients[i];
+        break;
+      }
+    if (!c) {
+      fprintf(stderr, "Too many clients, refusing connection.\n");
+      close(sock);
+      continue;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, NULL) | O_NONBLOCK);
+    bzero(c, sizeof(struct client));
+    c->fd = sock;
+    // Start from the next new frame
+    c->cursor = history_head;
+    c->resync = 1;
+    struct epoll_event ev = { EPOLLIN | EPOLLRDHUP, { .ptr = c } };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    printf("Client %d connected.\n", sock);
+  }
+}
+
+// Handle connections and client sockets, then send newly captured packets
+// to all clients that are keeping up.  capture() is called to collect
+// packets whenever the capture file descriptor is readable, or at least
+// every 10ms.
+void serve(void (*capture)(void))
+{
+  struct epoll_event events[MAX_CLIENTS + 2];
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, MAX_CLIENTS + 2, 10);
+    for (int i = 0; i < n; i++) {
+      struct client *c = events[i].data.ptr;
+      if (c == (struct client *)&listen_sock) {
+        clients_accept();
+        continue;
+      }
+      if (!c)
+        continue;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // Clients have nothing to say, so this is only ever them going away
+        unsigned char buffer[256];
+        ssize_t r = read(c->fd, buffer, sizeof(buffer));
+        if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+          client_close(c);
+          continue;
+        }
+      }
+      if (events[i].events & EPOLLOUT)
+        client_send(c);
+    }
+
+    capture();
+    multicast_send();
+
+    for (int i = 0; i < MAX_CLIENTS; i++)
+      if (clients[i].fd != -1 && !clients[i].blocked)
+        client_send(&clients[i]);
   }
+}
 
-  // If something was not provided
-  // return error.
-  if (dev == NULL) {
-    printf("\n[%s]\n", errbuf);
+int serve_init(int port)
+{
+  for (int i = 0; i < MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+  init_token_table();
+
+  listen_sock = create_listen_socket(port);
+  if (listen_sock == -1) {
+    perror("Could not listen for clients");
+    return -1;
+  }
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd == -1) {
+    perror("epoll_create1");
     return -1;
   }
+  struct epoll_event ev = { EPOLLIN, { .ptr = &listen_sock } };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev);
+  return 0;
+}
+
+void serve_capture_fd(int fd)
+{
+  struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+  capture_fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Capture using a TPACKET_V3 memory-mapped ring
+   ----------------------------------------------------------------------------------------------------------
+
+   The kernel fills blocks of the ring directly, and hands each block over once it is full or its
+   timeout expires, so there is no copy or system call per packet.  A socket filter drops everything
+   except video packets in the kernel.
+*/
+
+#define RING_BLOCK_SIZE (1 << 20)
+#define RING_BLOCK_COUNT 32
+#define RING_FRAME_SIZE 4096
+// Hand partly filled blocks to us after this many milliseconds, to limit latency
+#define RING_BLOCK_TIMEOUT 2
+
+// Accept only frames of exactly VIDEO_PACKET_SIZE bytes
+struct sock_filter video_filter[] = {
+  { BPF_LD | BPF_W | BPF_LEN, 0, 0, 0 },
+  { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, VIDEO_PACKET_SIZE },
+  { BPF_RET | BPF_K, 0, 0, 0xffffffff },
+  { BPF_RET | BPF_K, 0, 0, 0 },
+};
+
+int ring_fd = -1;
+unsigned char *ring = NULL;
 
-  // fetch the network address and network mask
-  pcap_lookupnet(dev, &pNet, &pMask, errbuf);
+int ring_open(char *dev)
+{
+  int ifindex = if_nametoindex(dev);
+  if (!ifindex) {
+    perror("if_nametoindex");
+    return -1;
+  }
 
-  // Now, open device for sniffing with big snaplen and
-  // promiscuous mode enabled.
-  descr = pcap_open_live(dev, 3000, 1, 10, errbuf);
+  ring_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  if (ring_fd == -1) {
+    perror("socket(AF_PACKET)");
+    return -1;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(ring_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+    perror("setsockopt(PACKET_VERSION)");
+    goto fail;
+  }
+
+  struct sock_fprog filter = { sizeof(video_filter) / sizeof(video_filter[0]), video_filter };
+  if (setsockopt(ring_fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1) {
+    perror("setsockopt(SO_ATTACH_FILTER)");
+    goto fail;
+  }
+
+  struct tpacket_req3 req;
+  bzero(&req, sizeof(req));
+  req.tp_block_size = RING_BLOCK_SIZE;
+  req.tp_block_nr = RING_BLOCK_COUNT;
+  req.tp_frame_size = RING_FRAME_SIZE;
+  req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCK_COUNT;
+  req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT;
+  if (setsockopt(ring_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+    perror("setsockopt(PACKET_RX_RING)");
+    goto fail;
+  }
+
+  ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, ring_fd, 0);
+  if (ring == MAP_FAILED) {
+    // MAP_LOCKED can fail due to RLIMIT_MEMLOCK, so try again without it
+    ring = mmap(NULL, RING_BLOCK_SIZE * RING_BLOCK_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (ring == MAP_FAILED) {
+      perror("mmap(PACKET_RX_RING)");
+      ring = NULL;
+      goto fail;
+    }
+  }
+
+  struct sockaddr_ll ll;
+  bzero(&ll, sizeof(ll));
+  ll.sll_family = AF_PACKET;
+  ll.sll_protocol = htons(ETH_P_ALL);
+  ll.sll_ifindex = ifindex;
+  if (bind(ring_fd, (struct sockaddr *)&ll, sizeof(ll)) == -1) {
+    perror("bind(AF_PACKET)");
+    goto fail;
+  }
+
+  // Promiscuous mode, as the video packets are not addressed to us
+  struct packet_mreq mr;
+  bzero(&mr, sizeof(mr));
+  mr.mr_ifindex = ifindex;
+  mr.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(ring_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) == -1)
+    perror("setsockopt(PACKET_ADD_MEMBERSHIP)");
+
+  return 0;
+
+fail:
+  if (ring)
+    munmap(ring, RING_BLOCK_SIZE * RING_BLOCK_COUNT);
+  ring = NULL;
+  close(ring_fd);
+  ring_fd = -1;
+  return -1;
+}
+
+unsigned int ring_block = 0;
+
+// Collect all packets from the blocks that the kernel has handed over
+void ring_capture(void)
+{
+  while (1) {
+    struct tpacket_block_desc *block = (struct tpacket_block_desc *)(ring + ring_block * RING_BLOCK_SIZE);
+    if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+      return;
+
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((unsigned char *)block + block->hdr.bh1.offset_to_first_pkt);
+    for (unsigned int i = 0; i < block->hdr.bh1.num_pkts; i++) {
+      struct sockaddr_ll *ll = (struct sockaddr_ll *)((unsigned char *)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+      // Ignore packets we are sending, e.g., when capturing on loopback
+      if (hdr->tp_snaplen == VIDEO_PACKET_SIZE && ll->sll_pkttype != PACKET_OUTGOING)
+        history_add((unsigned char *)hdr + hdr->tp_mac);
+      hdr = (struct tpacket3_hdr *)((unsigned char *)hdr + hdr->tp_next_offset);
+    }
+
+    // Give the block back to the kernel
+    __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring_block = (ring_block + 1) % RING_BLOCK_COUNT;
+  }
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Capture using libpcap, where a TPACKET_V3 ring cannot be used
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+pcap_t *descr = NULL;
+
+void pcap_packet(unsigned char *user, const struct pcap_pkthdr *hdr, const unsigned char *packet)
+{
+  if (hdr->caplen == VIDEO_PACKET_SIZE) {
+    // probably a C65GS compressed video frame.
+    history_add(packet);
+  }
+}
+
+void pcap_capture(void)
+{
+  // pcap_dispatch() hands us everything buffered so far
+  if (pcap_dispatch(descr, -1, pcap_packet, NULL) < 0) {
+    printf("pcap_dispatch() failed due to [%s]\n", pcap_geterr(descr));
+    exit(-1);
+  }
+}
+
+int pcap_open_video(char *dev)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+
+  // Immediate mode delivers packets as they arrive, instead of waiting for
+  // a buffer to fill or a timeout to expire.
+  descr = pcap_create(dev, errbuf);
   if (descr == NULL) {
-    printf("pcap_open_live() failed due to [%s]\n", errbuf);
+    printf("pcap_create() failed due to [%s]\n", errbuf);
+    return -1;
+  }
+  pcap_set_snaplen(descr, 3000);
+  pcap_set_promisc(descr, 1);
+  pcap_set_timeout(descr, 10);
+  pcap_set_immediate_mode(descr, 1);
+  pcap_set_buffer_size(descr, RING_BLOCK_SIZE * RING_BLOCK_COUNT);
+  if (pcap_activate(descr) < 0) {
+    printf("pcap_activate() failed due to [%s]\n", pcap_geterr(descr));
+    pcap_close(descr);
     return -1;
   }
 
-  printf("Started.\n");
-  fflush(stdout);
+  struct bpf_program fp;
+  char filter[64];
+  snprintf(filter, 64, "len == %d", VIDEO_PACKET_SIZE);
+  if (pcap_compile(descr, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(descr, &fp) == -1)
+    printf("Could not set capture filter: %s\n", pcap_geterr(descr));
+
+  char errbuf2[PCAP_ERRBUF_SIZE];
+  pcap_setnonblock(descr, 1, errbuf2);
+  int fd = pcap_get_selectable_fd(descr);
+  if (fd != -1)
+    serve_capture_fd(fd);
+  return 0;
+}
 
-  int listen_sock = create_listen_socket(6565);
+/* ----------------------------------------------------------------------------------------------------------
+   Self test
+   ----------------------------------------------------------------------------------------------------------
+
+   Sends packets to a client with a small socket buffer, that reads only a few bytes at a time, so
+   that most writes to it are only partly accepted, and checks that every byte arrives intact.  Then
+   lets the client fall more than the whole history behind while it is part way through a packet,
+   and checks that it still only gets whole packets, in order.  Each packet starts with its
+   sequence number, so that it can be recognised.
+*/
 
+#define SELF_TEST_PACKETS (HISTORY_PACKETS * 2)
+
+unsigned char self_test_byte(unsigned long long sequence, int offset)
+{
+  if (offset < 4)
+    return sequence >> ((3 - offset) * 8);
+  return (sequence * 131 + offset * 7 + (offset >> 8)) & 0xff;
+}
+
+void self_test_add_packet(void)
+{
+  unsigned char packet[VIDEO_PACKET_SIZE];
+  for (int i = 0; i < VIDEO_PACKET_SIZE; i++)
+    packet[i] = self_test_byte(history_head, i);
+  history_add(packet);
+}
+
+int self_test_lagging_client(struct client *c, int fd)
+{
+  for (int i = 0; !c->offset; i++) {
+    if (i == 256) {
+      fprintf(stderr, "FAIL: Could not leave a packet part way sent.\n");
+      return -1;
+    }
+    self_test_add_packet();
+    client_send(c);
+  }
+  for (int i = 0; i < HISTORY_PACKETS + 16; i++)
+    self_test_add_packet();
+
+  unsigned char packet[VIDEO_PACKET_SIZE];
+  int filled = 0;
+  long long last = -1;
+  int packets = 0;
   while (1) {
-    if (client_sock == -1) {
-      client_sock = accept_incoming(listen_sock);
-    }
-
-    struct pcap_pkthdr hdr;
-    hdr.caplen = 0;
-    const unsigned char *packet = pcap_next(descr, &hdr);
-    if (packet) {
-      if (hdr.caplen == 2132) {
-        // probably a C65GS compressed video frame.
-        if (client_sock != -1)
-          write(client_sock, packet, 2132);
+    client_send(c);
+    if (c->fd == -1)
+      return -1;
+    ssize_t r = recv(fd, &packet[filled], VIDEO_PACKET_SIZE - filled, MSG_DONTWAIT);
+    if (r < 1) {
+      if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("recv");
+        return -1;
+      }
+      if (c->cursor == history_head && !c->offset)
+        break;
+      continue;
+    }
+    filled += r;
+    if (filled < VIDEO_PACKET_SIZE)
+      continue;
+    filled = 0;
+    long long sequence = (packet[0] << 24) | (packet[1] << 16) | (packet[2] << 8) | packet[3];
+    for (int i = 4; i < VIDEO_PACKET_SIZE; i++)
+      if (packet[i] != self_test_byte(sequence, i)) {
+        fprintf(stderr, "FAIL: Byte %d of packet %lld is wrong after falling behind.\n", i, sequence);
+        return -1;
       }
+    if (sequence <= last) {
+      fprintf(stderr, "FAIL: Packet %lld was sent after packet %lld.\n", sequence, last);
+      return -1;
     }
+    last = sequence;
+    packets++;
+  }
+  if (filled) {
+    fprintf(stderr, "FAIL: Only %d bytes of the last packet were sent.\n", filled);
+    return -1;
+  }
+  printf("PASS: A client that fell behind part way through a packet was sent %d whole packets in order.\n",
+      packets);
+  return 0;
+}
+
+int self_test(void)
+{
+  // TCP accepts as much of each write as there is room for, which over
+  // loopback with small buffers is often less than a packet
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  int size = 4096;
+  int fds[2] = { -1, socket(AF_INET, SOCK_STREAM, 0) };
+  int sock = create_listen_socket(0);
+  if (sock == -1 || fds[1] == -1 || getsockname(sock, (struct sockaddr *)&address, &address_len)) {
+    perror("Could not set up self test connection");
+    return -1;
+  }
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  if (connect(fds[1], (struct sockaddr *)&address, sizeof(address)) || (fds[0] = accept_incoming(sock)) == -1) {
+    perror("Could not set up self test connection");
+    return -1;
   }
+  close(sock);
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, NULL) | O_NONBLOCK);
+
+  init_token_table();
+  struct client *c = &clients[0];
+  bzero(c, sizeof(struct client));
+  c->fd = fds[0];
+
+  unsigned long long received = 0;
+  while (received < (unsigned long long)SELF_TEST_PACKETS * VIDEO_PACKET_SIZE) {
+    // Keep a few packets waiting, but not so many that the client is made to skip ahead
+    while (history_head < SELF_TEST_PACKETS && history_head - c->cursor < 4)
+      self_test_add_packet();
+    client_send(c);
+    if (c->fd == -1)
+      return -1;
+
+    unsigned char buffer[16];
+    ssize_t r = read(fds[1], buffer, 1 + received % sizeof(buffer));
+    if (r < 1) {
+      perror("read");
+      return -1;
+    }
+    for (int i = 0; i < r; i++, received++) {
+      if (buffer[i] != self_test_byte(received / VIDEO_PACKET_SIZE, received % VIDEO_PACKET_SIZE)) {
+        fprintf(stderr, "FAIL: Byte %lld of packet %lld is wrong.\n", received % VIDEO_PACKET_SIZE,
+            received / VIDEO_PACKET_SIZE);
+        return -1;
+      }
+    }
+  }
+  printf("PASS: %d packets sent intact to a slow client.\n", SELF_TEST_PACKETS);
+
+  int result = self_test_lagging_client(c, fds[1]);
+  close(fds[0]);
+  close(fds[1]);
+  return result;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: videoproxy [-m <group>[:port]] [-t ttl] <interface>\n");
+  fprintf(stderr, "       videoproxy -T\n");
+  fprintf(stderr, "  Serves captured video packets via TCP on port 6565, and optionally\n");
+  fprintf(stderr, "  re-broadcasts them to a UDP multicast group (default port 6565).\n");
+  fprintf(stderr, "  -T runs a self test of sending to clients that are slow to read.\n");
+  exit(-3);
+}
+
+int main(int argc, char **argv)
+{
+  char *dev;
+  char *multicast_group = NULL;
+  int multicast_ttl = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:t:T")) != -1) {
+    switch (opt) {
+    case 'm':
+      multicast_group = optarg;
+      break;
+    case 't':
+      multicast_ttl = atoi(optarg);
+      break;
+    case 'T':
+      return self_test() ? -1 : 0;
+    default:
+      usage();
+    }
+  }
+
+  if (argv[optind])
+    dev = argv[optind];
+  else {
+    fprintf(stderr, "You must specify the interface to listen on.\n");
+    usage();
+  }
+
+  if (serve_init(6565))
+    exit(-1);
+  if (multicast_group && multicast_open(multicast_group, multicast_ttl))
+    exit(-1);
+
+  // A client going away must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!ring_open(dev)) {
+    serve_capture_fd(ring_fd);
+    printf("Started (capturing via TPACKET_V3 ring).\n");
+    fflush(stdout);
+    serve(ring_capture);
+  }
+
+  fprintf(stderr, "Could not set up capture ring, falling back to libpcap.\n");
+  if (pcap_open_video(dev))
+    exit(-1);
+  printf("Started.\n");
+  fflush(stdout);
+  serve(pcap_capture);
   printf("Exiting.\n");
 
   return 0;
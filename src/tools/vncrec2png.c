@@ -0,0 +1,125 @@
+/*
+  Convert a frame recording made by vncserver --record into a series of
+  PNG images, one per recorded frame.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <png.h>
+
+int read_u32(FILE *f, uint32_t *v)
+{
+  unsigned char b[4];
+  if (fread(b, 4, 1, f) != 1)
+    return -1;
+  *v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr, "usage: vncrec2png <recording> [output prefix] [first frame] [last frame]\n");
+    exit(-3);
+  }
+  char *prefix = argc > 2 ? argv[2] : "frame";
+  int first = argc > 3 ? atoi(argv[3]) : 0;
+  int last = argc > 4 ? atoi(argv[4]) : -1;
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror("Could not open recording");
+    exit(-1);
+  }
+
+  char magic[8];
+  uint32_t version, width, height, bpp;
+  if (fread(magic, 8, 1, f) != 1 || memcmp(magic, "MEGA65VR", 8) || read_u32(f, &version) || read_u32(f, &width)
+      || read_u32(f, &height) || read_u32(f, &bpp)) {
+    fprintf(stderr, "%s is not a vncserver recording.\n", argv[1]);
+    exit(-1);
+  }
+  if (version != 1 || bpp != 4 || !width || !height || width > 4096 || height > 4096) {
+    fprintf(stderr, "Unsupported recording: version %d, %dx%d, %d bytes per pixel.\n", version, width, height, bpp);
+    exit(-1);
+  }
+
+  uLongf frame_size = width * height * bpp;
+  unsigned char *frame = calloc(frame_size, 1);
+  unsigned char *delta = malloc(frame_size);
+  unsigned char *rgb = malloc(width * height * 3);
+  unsigned char *compressed = malloc(compressBound(frame_size));
+  if (!frame || !delta || !rgb || !compressed) {
+    perror("malloc()");
+    exit(-1);
+  }
+
+  int frame_number = 0;
+  int written = 0;
+  while (last == -1 || frame_number <= last) {
+    uint32_t ts_lo, ts_hi, len;
+    if (read_u32(f, &ts_lo) || read_u32(f, &ts_hi) || read_u32(f, &len))
+      break;
+    if (len > compressBound(frame_size) || fread(compressed, len, 1, f) != 1) {
+      fprintf(stderr, "Recording is truncated at frame %d.\n", frame_number);
+      break;
+    }
+    uLongf delta_len = frame_size;
+    if (uncompress(delta, &delta_len, compressed, len) != Z_OK || delta_len != frame_size) {
+      fprintf(stderr, "Frame %d is corrupt.\n", frame_number);
+      break;
+    }
+    // Every frame is a delta against the one before, so all frames have to
+    // be decoded, even those that are not written out.
+    for (uLongf i = 0; i < frame_size; i++)
+      frame[i] ^= delta[i];
+
+    if (frame_number >= first) {
+      for (uint32_t i = 0; i < width * height; i++) {
+        rgb[i * 3 + 0] = frame[i * 4 + 0];
+        rgb[i * 3 + 1] = frame[i * 4 + 1];
+        rgb[i * 3 + 2] = frame[i * 4 + 2];
+      }
+
+      char filename[1024];
+      snprintf(filename, 1024, "%s%06d.png", prefix, frame_number);
+      png_image image;
+      bzero(&image, sizeof(image));
+      image.version = PNG_IMAGE_VERSION;
+      image.width = width;
+      image.height = height;
+      image.format = PNG_FORMAT_RGB;
+      if (!png_image_write_to_file(&image, filename, 0, rgb, 0, NULL)) {
+        fprintf(stderr, "Could not write %s: %s\n", filename, image.message);
+        exit(-1);
+      }
+      unsigned long long timestamp = ts_lo | ((unsigned long long)ts_hi << 32);
+      printf("%s: %.3f seconds\n", filename, timestamp / 1000000000.0);
+      written++;
+    }
+    frame_number++;
+  }
+
+  fclose(f);
+  printf("Wrote %d of %d frames.\n", written, frame_number);
+  return 0;
+}
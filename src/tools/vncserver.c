@@ -17,17 +17,23 @@
 #include <time.h>
 #include <poll.h>
 #include <termios.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 int sendScanCode(int scan_code);
 
 int raster_line_number = -1;
 unsigned int raster_line[800];
 
-int colour0, colour1, colour2, colour3, colour4;
-
 int image_offset = 0;
 int drawing = 0;
-int y;
+
+int debug = 0; // x806; //0x21b;
 
 #ifdef WIN32
 #define sleep Sleep
@@ -41,11 +47,6 @@ int y;
 static const int bpp = 4;
 static int maxx = 800, maxy = 600;
 
-static void initBuffer(unsigned char *buffer)
-{
-  bzero(buffer, maxx * maxy);
-}
-
 /* Here we create a structure so that every client has it's own pointer */
 
 typedef struct ClientData {
@@ -75,7 +76,7 @@ static void newframebuffer(rfbScreenInfoPtr screen, int width, int height)
   maxy = height;
   oldfb = (unsigned char*)screen->frameBuffer;
   newfb = (unsigned char*)malloc(maxx * maxy * bpp);
-  initBuffer(newfb);
+  bzero(newfb, maxx * maxy * bpp);
   rfbNewFramebuffer(screen, (char*)newfb, maxx, maxy, 8, 3, bpp);
   free(oldfb);
 }
@@ -362,11 +363,230 @@ static void dokey(rfbBool down, rfbKeySym key, rfbClientPtr cl)
   }
 }
 
-int updateFrameBuffer(rfbScreenInfoPtr screen)
+unsigned long long monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Recording of decoded frames
+   ----------------------------------------------------------------------------------------------------------
+
+   Recordings start with a header of "MEGA65VR", then the format version (1), width, height and
+   bytes per pixel (4) as little-endian 32-bit values.  Each changed frame follows as a 64-bit
+   timestamp in nanoseconds since the start of the recording, a 32-bit length, and then the zlib
+   compressed XOR of the frame with the previously recorded frame.  For a mostly static screen the
+   XOR is almost entirely zero, and so compresses to very little.
+
+   Frames are handed to a separate writer thread through a small ring, so that compression and
+   disk writes never stall decoding.  If the writer falls behind, frames are skipped, which is
+   safe because each delta is against the previous frame actually recorded.  If a write fails,
+   e.g., because the disk is full, recording stops, but the server keeps running.  Use vncrec2png
+   to convert a recording to PNG images.
+*/
+
+#define RECORD_QUEUE_FRAMES 8
+
+FILE *record_file = NULL;
+uint32_t *record_queue[RECORD_QUEUE_FRAMES];
+unsigned long long record_timestamp[RECORD_QUEUE_FRAMES];
+unsigned int record_queue_head = 0;
+unsigned int record_queue_tail = 0;
+unsigned long long record_start = 0;
+unsigned long long frames_recorded = 0;
+unsigned long long frames_not_recorded = 0;
+// Set by the decoder when it is time to finish, and by the writer if a write fails
+int record_stopping = 0;
+int record_failed = 0;
+pthread_t recordThread;
+
+int record_u32(uint32_t v)
+{
+  unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+  return fwrite(b, 4, 1, record_file) != 1;
+}
+
+int record_u64(unsigned long long v)
+{
+  return record_u32(v) || record_u32(v >> 32);
+}
+
+void *record_writer(void *arg)
 {
-  // Tell VNC that everything has changed, and let it do the optimisation.
+  int pixels = maxx * maxy;
+  uint32_t *previous = calloc(pixels, bpp);
+  uint32_t *delta = malloc(pixels * bpp);
+  uLongf compressed_max = compressBound(pixels * bpp);
+  unsigned char *compressed = malloc(compressed_max);
+  if (!previous || !delta || !compressed) {
+    perror("malloc()");
+    exit(-1);
+  }
+
+  while (1) {
+    unsigned int tail = record_queue_tail;
+    if (tail == __atomic_load_n(&record_queue_head, __ATOMIC_ACQUIRE)) {
+      if (__atomic_load_n(&record_stopping, __ATOMIC_ACQUIRE))
+        break;
+      usleep(5000);
+      continue;
+    }
+    uint32_t *frame = record_queue[tail % RECORD_QUEUE_FRAMES];
+    unsigned long long timestamp = record_timestamp[tail % RECORD_QUEUE_FRAMES];
 
-  rfbMarkRectAsModified(screen, 0, 0, maxx - 1, maxy - 1);
+    for (int i = 0; i < pixels; i++) {
+      delta[i] = frame[i] ^ previous[i];
+      previous[i] = frame[i];
+    }
+    __atomic_store_n(&record_queue_tail, tail + 1, __ATOMIC_RELEASE);
+
+    uLongf compressed_len = compressed_max;
+    if (compress2(compressed, &compressed_len, (unsigned char *)delta, pixels * bpp, 1) != Z_OK) {
+      fprintf(stderr, "Could not compress frame for recording.\n");
+      exit(-1);
+    }
+    // Keep the recording usable even if we are killed part way through a long run
+    if (record_u64(timestamp) || record_u32(compressed_len)
+        || fwrite(compressed, compressed_len, 1, record_file) != 1 || fflush(record_file)) {
+      perror("Could not write recording, so recording has stopped");
+      __atomic_store_n(&record_failed, 1, __ATOMIC_RELEASE);
+      break;
+    }
+    frames_recorded++;
+  }
+  fclose(record_file);
+  free(previous);
+  free(delta);
+  free(compressed);
+  return NULL;
+}
+
+int record_open(char *filename)
+{
+  record_file = fopen(filename, "wb");
+  if (!record_file) {
+    perror("Could not open recording file");
+    return -1;
+  }
+  for (int i = 0; i < RECORD_QUEUE_FRAMES; i++) {
+    record_queue[i] = malloc(maxx * maxy * bpp);
+    if (!record_queue[i]) {
+      perror("malloc()");
+      return -1;
+    }
+  }
+  if (fwrite("MEGA65VR", 8, 1, record_file) != 1 || record_u32(1) || record_u32(maxx) || record_u32(maxy)
+      || record_u32(bpp)) {
+    perror("Could not write recording");
+    return -1;
+  }
+  record_start = monotonic_ns();
+  pthread_create(&recordThread, NULL, record_writer, NULL);
+  printf("Recording frames to %s\n", filename);
+  return 0;
+}
+
+// Waits for the frames still queued to be written, and reports how many were
+void record_close(void)
+{
+  __atomic_store_n(&record_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(recordThread, NULL);
+  printf("%llu frames recorded, %llu not recorded.\n", frames_recorded, frames_not_recorded);
+}
+
+void record_frame(uint32_t *frame)
+{
+  unsigned int head = record_queue_head;
+  if (__atomic_load_n(&record_failed, __ATOMIC_ACQUIRE)
+      || head - __atomic_load_n(&record_queue_tail, __ATOMIC_ACQUIRE) >= RECORD_QUEUE_FRAMES) {
+    frames_not_recorded++;
+    return;
+  }
+  memcpy(record_queue[head % RECORD_QUEUE_FRAMES], frame, maxx * maxy * bpp);
+  record_timestamp[head % RECORD_QUEUE_FRAMES] = monotonic_ns() - record_start;
+  __atomic_store_n(&record_queue_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// The decoder draws into its own buffer, and completed frames are copied to
+// whichever of the two display buffers VNC is not currently encoding from,
+// which is then swapped in.  This way clients never see a partly drawn frame.
+// Each client's output thread encodes while holding its sendMutex, so once
+// every client's sendMutex has been taken after the swap, nothing is still
+// encoding from the old buffer, and the next frame can be copied into it.
+uint32_t *display_buffer[2];
+int display_front = 0;
+
+void wait_for_encoders(rfbScreenInfoPtr screen)
+{
+  rfbClientIteratorPtr i = rfbGetClientIterator(screen);
+  rfbClientPtr cl;
+  while ((cl = rfbClientIteratorNext(i))) {
+    LOCK(cl->sendMutex);
+    UNLOCK(cl->sendMutex);
+  }
+  rfbReleaseClientIterator(i);
+}
+
+struct dirty_rect {
+  int x1, y1, x2, y2;
+};
+struct dirty_rect dirty_rects[600];
+
+int updateFrameBuffer(rfbScreenInfoPtr screen, uint32_t *decoded)
+{
+  uint32_t *front = display_buffer[display_front];
+  uint32_t *back = display_buffer[!display_front];
+  int dirty_count = 0;
+
+  // Only mark the parts of the screen that have changed since the last
+  // frame.  Consecutive changed lines are merged into a single rectangle
+  // spanning the changed columns of all of them.
+  int first_y = -1, left = maxx, right = 0;
+  for (int y = 0; y < maxy; y++) {
+    uint32_t *now = &decoded[y * maxx];
+    uint32_t *was = &front[y * maxx];
+    if (!memcmp(now, was, maxx * bpp)) {
+      if (first_y != -1) {
+        dirty_rects[dirty_count++] = (struct dirty_rect) { left, first_y, right, y };
+        first_y = -1;
+      }
+      continue;
+    }
+    int x1 = 0, x2 = maxx;
+    while (now[x1] == was[x1])
+      x1++;
+    while (now[x2 - 1] == was[x2 - 1])
+      x2--;
+    if (first_y == -1) {
+      first_y = y;
+      left = x1;
+      right = x2;
+    }
+    else {
+      if (x1 < left)
+        left = x1;
+      if (x2 > right)
+        right = x2;
+    }
+  }
+  if (first_y != -1)
+    dirty_rects[dirty_count++] = (struct dirty_rect) { left, first_y, right, maxy };
+
+  if (!dirty_count)
+    return 0;
+
+  memcpy(back, decoded, maxx * maxy * bpp);
+  display_front = !display_front;
+  __atomic_store_n(&screen->frameBuffer, (char *)back, __ATOMIC_RELEASE);
+  wait_for_encoders(screen);
+
+  if (record_file)
+    record_frame(decoded);
+
+  for (int i = 0; i < dirty_count; i++)
+    rfbMarkRectAsModified(screen, dirty_rects[i].x1, dirty_rects[i].y1, dirty_rects[i].x2, dirty_rects[i].y2);
 
   return 0;
 }
@@ -612,31 +832,769 @@ int openSerialPort(char *port)
   return 0;
 }
 
-int setPixel(rfbScreenInfoPtr screen, int x, int y, uint32_t v)
+/* ----------------------------------------------------------------------------------------------------------
+   Compressed video stream decoder
+   ----------------------------------------------------------------------------------------------------------
+
+   The stream produced by framepacker.vhdl is a prefix code, most significant bit first:
+
+   0                      = previous pixel colour
+   10                     = pen-ultimate pixel colour
+   1100, 1101, 1110       = colour of three other most recent pixel colours
+   11110 cccccccccccc     = explicit 12-bit pixel colour
+   111110 yyyyyyyyyy      = new raster, with raster number
+   11111100               = new frame
+   11111101               = reserved
+   11111110 nnnnnnnn      = run of n pixels of the last colour
+   11111111               = end of packet marker
+
+   Every token can be identified from its first 8 bits, so a 256 entry table gives the token
+   type and length, and runs of 0 bits (repeated pixels) are consumed several at a time.
+*/
+
+#define VIDEO_PACKET_HEADER 0x56
+// Longest possible token, including the longest lookahead of the original bit-string decoder
+#define VIDEO_TOKEN_LOOKAHEAD 20
+
+enum {
+  TOKEN_SAME,
+  TOKEN_COLOUR1,
+  TOKEN_COLOUR2,
+  TOKEN_COLOUR3,
+  TOKEN_COLOUR4,
+  TOKEN_EXPLICIT,
+  TOKEN_RASTER,
+  TOKEN_FRAME,
+  TOKEN_RESERVED,
+  TOKEN_RLE,
+  TOKEN_NONE
+};
+
+unsigned char token_type[256];
+unsigned char token_len[256];
+
+void init_token_table(void)
+{
+  for (int b = 0; b < 256; b++) {
+    if (!(b & 0x80)) {
+      token_type[b] = TOKEN_SAME;
+      token_len[b] = 1;
+    }
+    else if ((b & 0xc0) == 0x80) {
+      token_type[b] = TOKEN_COLOUR1;
+      token_len[b] = 2;
+    }
+    else if ((b & 0xf0) == 0xc0) {
+      token_type[b] = TOKEN_COLOUR2;
+      token_len[b] = 4;
+    }
+    else if ((b & 0xf0) == 0xd0) {
+      token_type[b] = TOKEN_COLOUR3;
+      token_len[b] = 4;
+    }
+    else if ((b & 0xf0) == 0xe0) {
+      token_type[b] = TOKEN_COLOUR4;
+      token_len[b] = 4;
+    }
+    else if ((b & 0xf8) == 0xf0) {
+      token_type[b] = TOKEN_EXPLICIT;
+      token_len[b] = 5 + 12;
+    }
+    else if ((b & 0xfc) == 0xf8) {
+      token_type[b] = TOKEN_RASTER;
+      token_len[b] = 6 + 10;
+    }
+    else if (b == 0xfc) {
+      token_type[b] = TOKEN_FRAME;
+      token_len[b] = 8;
+    }
+    else if (b == 0xfd) {
+      token_type[b] = TOKEN_RESERVED;
+      token_len[b] = 8;
+    }
+    else if (b == 0xfe) {
+      token_type[b] = TOKEN_RLE;
+      token_len[b] = 8 + 8;
+    }
+    else {
+      // End of packet marker: skip a bit at a time until something matches,
+      // as the original decoder did
+      token_type[b] = TOKEN_NONE;
+      token_len[b] = 1;
+    }
+  }
+}
+
+// Colours are kept in framebuffer byte order (R,G,B,0 in memory on a little-endian host),
+// so that they can be stored without conversion.
+#define RGB_TO_PIXEL(v) ((((v) >> 16) & 0xff) | ((v)&0xff00) | (((v)&0xff) << 16))
+
+struct video_decoder {
+  uint32_t *framebuffer;
+  int width, height;
+  int x, y, lasty;
+  // Row of the framebuffer for raster y, or NULL if y is off screen
+  uint32_t *row;
+  uint32_t colour[5];
+  // Number of pixels decoded, for benchmarking
+  unsigned long long pixels;
+  // Called on each new frame token
+  void (*new_frame)(struct video_decoder *d);
+  void *context;
+};
+
+void decoder_reset_colours(struct video_decoder *d)
+{
+  d->colour[0] = RGB_TO_PIXEL(0x000000);
+  d->colour[1] = RGB_TO_PIXEL(0xf0f0f0);
+  d->colour[2] = RGB_TO_PIXEL(0x303030);
+  d->colour[3] = RGB_TO_PIXEL(0x707070);
+  d->colour[4] = RGB_TO_PIXEL(0xb0b0b0);
+}
+
+void decoder_set_y(struct video_decoder *d, int y)
+{
+  d->y = y;
+  d->row = (y >= 0 && y < d->height) ? d->framebuffer + y * d->width : NULL;
+}
+
+void decoder_init(struct video_decoder *d, uint32_t *framebuffer, int width, int height)
+{
+  bzero(d, sizeof(struct video_decoder));
+  d->framebuffer = framebuffer;
+  d->width = width;
+  d->height = height;
+  d->x = 0;
+  decoder_set_y(d, -1);
+  d->lasty = -1;
+  decoder_reset_colours(d);
+}
+
+// Fill count pixels starting at dst with v
+static inline void fill_span(uint32_t *dst, uint32_t v, int count)
+{
+#ifdef __SSE2__
+  if (count >= 8) {
+    __m128i v4 = _mm_set1_epi32(v);
+    // Align the destination, so that the bulk of the span uses aligned stores
+    while ((uintptr_t)dst & 15) {
+      *dst++ = v;
+      count--;
+    }
+    for (; count >= 8; count -= 8, dst += 8) {
+      _mm_store_si128((__m128i *)dst, v4);
+      _mm_store_si128((__m128i *)(dst + 4), v4);
+    }
+  }
+#endif
+  while (count-- > 0)
+    *dst++ = v;
+}
+
+static inline void put_pixel(struct video_decoder *d, uint32_t v)
+{
+  if (d->row && d->x >= 0 && d->x < d->width)
+    d->row[d->x] = v;
+  d->x++;
+  d->pixels++;
+}
+
+static inline void put_pixels(struct video_decoder *d, uint32_t v, int count)
+{
+  if (d->row) {
+    int start = d->x < 0 ? 0 : d->x;
+    int end = d->x + count > d->width ? d->width : d->x + count;
+    if (end > start)
+      fill_span(&d->row[start], v, end - start);
+  }
+  d->x += count;
+  d->pixels += count;
+}
+
+// Fill the rest of the current raster line with colour v
+void set_raster(struct video_decoder *d, uint32_t v)
+{
+  if (d->row && d->x >= 0 && d->x < d->width)
+    fill_span(&d->row[d->x], v, d->width - d->x);
+}
+
+// Move colour n to the front of the most recently used list
+static inline void use_colour(struct video_decoder *d, int n)
+{
+  uint32_t t = d->colour[n];
+  for (; n; n--)
+    d->colour[n] = d->colour[n - 1];
+  d->colour[0] = t;
+}
+
+// Return the 32 bits starting at bitpos, most significant bit first.
+// Reads up to 5 bytes beyond the byte containing bitpos.
+static inline uint32_t peek_bits(const unsigned char *p, unsigned int bitpos)
+{
+  const unsigned char *b = p + (bitpos >> 3);
+  uint32_t v = ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+  int shift = bitpos & 7;
+  if (shift)
+    v = (v << shift) | (b[4] >> (8 - shift));
+  return v;
+}
+
+// Decode one video packet.  The packet buffer must have at least 4 readable
+// bytes beyond len.
+void decode_video_packet(struct video_decoder *d, const unsigned char *packet, int len)
+{
+  if (len * 8 < VIDEO_PACKET_HEADER * 8 + VIDEO_TOKEN_LOOKAHEAD)
+    return;
+
+  // The original decoder only recognised tokens once 20 bits of look-ahead
+  // were available, so tokens starting in the last 19 bits of a packet are
+  // ignored, to keep the decoded output identical.
+  unsigned int last_start = len * 8 - VIDEO_TOKEN_LOOKAHEAD;
+  unsigned int bitpos = VIDEO_PACKET_HEADER * 8;
+
+  // Start outside frame so that we can synchronise without visible artefacts
+  d->lasty = -1;
+  decoder_set_y(d, -1);
+
+  while (bitpos <= last_start) {
+    uint32_t bits = peek_bits(packet, bitpos);
+
+    if (!(bits & 0x80000000)) {
+      // One or more repeats of the last colour
+      unsigned int n = bits ? __builtin_clz(bits) : 32;
+      if (n > last_start - bitpos + 1)
+        n = last_start - bitpos + 1;
+      bitpos += n;
+      if (d->x != -1)
+        put_pixels(d, d->colour[0], n);
+      continue;
+    }
+
+    unsigned char b = bits >> 24;
+    bitpos += token_len[b];
+
+    switch (token_type[b]) {
+    case TOKEN_COLOUR1:
+      use_colour(d, 1);
+      if (d->x != -1)
+        put_pixel(d, d->colour[0]);
+      break;
+    case TOKEN_COLOUR2:
+      use_colour(d, 2);
+      if (d->x != -1)
+        put_pixel(d, d->colour[0]);
+      break;
+    case TOKEN_COLOUR3:
+      use_colour(d, 3);
+      if (d->x != -1)
+        put_pixel(d, d->colour[0]);
+      break;
+    case TOKEN_COLOUR4:
+      use_colour(d, 4);
+      if (d->x != -1)
+        put_pixel(d, d->colour[0]);
+      break;
+    case TOKEN_EXPLICIT: {
+      unsigned int c = (bits >> 15) & 0xfff;
+      d->colour[4] = d->colour[3];
+      d->colour[3] = d->colour[2];
+      d->colour[2] = d->colour[1];
+      d->colour[1] = d->colour[0];
+      d->colour[0] = RGB_TO_PIXEL(((c & 0xf) << 4) | ((c & 0xf0) << 8) | ((c & 0xf00) << 12));
+      if (debug & 0x800)
+        printf("Saw new colour $%03x at (%d,%d)\n", c, d->x, d->y);
+      put_pixel(d, d->colour[0]);
+    } break;
+    case TOKEN_RASTER: {
+      set_raster(d, d->colour[0]);
+      int y = (bits >> 16) & 0x3ff;
+      if (d->lasty == -1) {
+        d->lasty = y;
+        y = -1;
+      }
+      else {
+        if ((y != (1 + d->lasty)) && (y != d->lasty)) {
+          // Non successive raster lines, block drawing
+          if (debug & 2)
+            printf("lasty was %d, new y = %d\n", d->lasty, y);
+          d->lasty = y;
+          y = -1;
+        }
+        else
+          d->lasty = y;
+      }
+      decoder_set_y(d, y);
+      if (debug & 2)
+        printf("Raster #%d (MAX X value seen was %d)\n", y, d->x);
+      d->x = 0;
+      decoder_reset_colours(d);
+    } break;
+    case TOKEN_RLE: {
+      int r = (bits >> 16) & 0xff;
+      if (debug & 8)
+        printf("Run of %d at %d,%d\n", r, d->x, d->y);
+      if (d->x != -1) {
+        if (r > d->width - d->x)
+          r = d->width - d->x;
+        if (r > 0)
+          put_pixels(d, d->colour[0], r);
+      }
+      if (debug & 8)
+        printf("After run, x=%d\n", d->x);
+    } break;
+    case TOKEN_FRAME:
+      if (debug & 1)
+        printf("New frame (y got to %d)\n", d->y);
+      if (d->y != -1)
+        set_raster(d, d->colour[0]);
+      decoder_set_y(d, -1);
+      d->x = -1;
+      decoder_reset_colours(d);
+      if (d->new_frame)
+        d->new_frame(d);
+      break;
+    case TOKEN_RESERVED:
+      // Reserved -- this is an error for now
+      if (debug & 0x100)
+        printf("Reserved token.\n");
+      break;
+    }
+  }
+}
+
+void newFrame(struct video_decoder *d)
+{
+  updateFrameBuffer((rfbScreenInfoPtr)d->context, d->framebuffer);
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Packet queue between the reader and decoder threads
+   ----------------------------------------------------------------------------------------------------------
+
+   Single producer, single consumer ring.  The reader thread only ever writes packet_queue_head, and
+   the decoder only ever writes packet_queue_tail, so no locks are needed.  If the decoder falls
+   behind, packets are dropped rather than making the reader wait, so that the socket keeps being
+   drained.
+*/
+
+#define VIDEO_PACKET_SIZE 2132
+#define PACKET_QUEUE_SLOTS 256
+
+struct queued_packet {
+  int len;
+  // Extra room for the dummy data path, and for the decoder's look-ahead
+  unsigned char data[8192 + 8];
+};
+
+struct queued_packet packet_queue[PACKET_QUEUE_SLOTS];
+unsigned int packet_queue_head = 0;
+unsigned int packet_queue_tail = 0;
+unsigned long long packets_dropped = 0;
+
+// Returns the slot to read the next packet into, or NULL if the queue is full
+struct queued_packet *packet_queue_reserve(void)
+{
+  unsigned int head = packet_queue_head;
+  if (head - __atomic_load_n(&packet_queue_tail, __ATOMIC_ACQUIRE) >= PACKET_QUEUE_SLOTS)
+    return NULL;
+  return &packet_queue[head % PACKET_QUEUE_SLOTS];
+}
+
+void packet_queue_push(void)
+{
+  __atomic_store_n(&packet_queue_head, packet_queue_head + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the oldest queued packet, or NULL if the queue is empty
+struct queued_packet *packet_queue_peek(void)
+{
+  unsigned int tail = packet_queue_tail;
+  if (tail == __atomic_load_n(&packet_queue_head, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &packet_queue[tail % PACKET_QUEUE_SLOTS];
+}
+
+void packet_queue_pop(void)
+{
+  __atomic_store_n(&packet_queue_tail, packet_queue_tail + 1, __ATOMIC_RELEASE);
+}
+
+int video_sock = -1;
+int do_dummy = 0;
+pthread_t readerThread;
+
+void *packet_reader(void *arg)
+{
+  // The dummy data path can write as much as a queued packet holds
+  unsigned char discard[sizeof(packet_queue[0].data)];
+
+  while (1) {
+    struct queued_packet *p = packet_queue_reserve();
+    unsigned char *packet = p ? p->data : discard;
+    int len;
+
+    if (do_dummy) {
+      // Feed dummy data (from simulation) to test
+      len = 0;
+      FILE *f = fopen("dummy.dat", "r");
+      if (f) {
+        char line[1024];
+        len = 0x56;
+        line[0] = 0;
+        fgets(line, 1024, f);
+        while (line[0] && (len < 8000)) {
+          packet[len++] = strtoll(line, NULL, 16);
+          line[0] = 0;
+          fgets(line, 1024, f);
+        }
+        fclose(f);
+      }
+      else
+        usleep(10000);
+    }
+    else {
+      len = read(video_sock, packet, VIDEO_PACKET_SIZE);
+      if (len < 1)
+        usleep(10000);
+    }
+
+    if (len > 2100) {
+      // probably a C65GS compressed video frame.
+      if (!p) {
+        packets_dropped++;
+        if (!(packets_dropped & (packets_dropped - 1)))
+          fprintf(stderr, "Decoder is falling behind: %lld video packets dropped.\n", packets_dropped);
+        continue;
+      }
+      p->len = len;
+      packet_queue_push();
+    }
+  }
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Receiving video from videoproxy -m via UDP multicast
+   ----------------------------------------------------------------------------------------------------------
+
+   Each datagram is one video packet, with the data before offset 0x56 replaced by a 12 byte header
+   of "M65V", a 32-bit sequence number and flags (see videoproxy.c).  Lost packets need no special
+   handling, because every packet starts on a token boundary, and the decoder does not draw again
+   until it has seen successive raster tokens.  We just count them, and discard late or duplicate
+   packets.  A packet from well before the last one, or several in a row from before it, means
+   that videoproxy has been restarted, and so its sequence numbers are followed from there.
+*/
+
+#define MULTICAST_HEADER_SIZE 12
+// Packets this far back are not late, but from a new stream
+#define MULTICAST_RESTART_GAP 1024
+#define MULTICAST_RESTART_PACKETS 8
+
+char *multicast_spec = NULL;
+unsigned long long multicast_lost = 0;
+
+int multicast_join(char *spec)
 {
-  //  printf("(%d,%d) = %08x\n",x,y,v);
-  if (y >= 0 && y < maxy && x >= 0 && x < maxx) {
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 3] = 0;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 2] = v & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 1] = (v >> 8) & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 0] = (v >> 16) & 0xff;
+  char group[256];
+  int port = 6565;
+  struct in_addr addr;
+  if (sscanf(spec, "%255[^:]:%d", group, &port) < 1 || inet_pton(AF_INET, group, &addr) != 1) {
+    fprintf(stderr, "Could not parse multicast group '%s'\n", spec);
+    return -1;
+  }
+
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == -1) {
+    perror("socket(SOCK_DGRAM)");
+    return -1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  // Allow for bursts while the decoder is busy
+  int rcvbuf = 4 << 20;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct sockaddr_in local;
+  bzero(&local, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = INADDR_ANY;
+  local.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr *)&local, sizeof(local)) == -1) {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+
+  if (IN_MULTICAST(ntohl(addr.s_addr))) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = addr;
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1) {
+      perror("setsockopt(IP_ADD_MEMBERSHIP)");
+      close(sock);
+      return -1;
+    }
+  }
+  printf("Receiving video from %s:%d\n", group, port);
+  return sock;
+}
+
+void *multicast_reader(void *arg)
+{
+  int sock = multicast_join(multicast_spec);
+  if (sock == -1)
+    exit(-1);
+
+  unsigned char discard[VIDEO_PACKET_SIZE];
+  uint32_t expected = 0;
+  int have_sequence = 0;
+  int late_packets = 0;
+
+  while (1) {
+    struct queued_packet *p = packet_queue_reserve();
+    unsigned char *packet = p ? p->data : discard;
+
+    // Receive so that the video data lands at offset 0x56, as for packets
+    // from the TCP stream
+    ssize_t r = recv(sock, &packet[0x56 - MULTICAST_HEADER_SIZE], VIDEO_PACKET_SIZE - 0x56 + MULTICAST_HEADER_SIZE, 0);
+    if (r != VIDEO_PACKET_SIZE - 0x56 + MULTICAST_HEADER_SIZE) {
+      if (r == -1 && errno != EINTR)
+        perror("recv");
+      continue;
+    }
+    unsigned char *h = &packet[0x56 - MULTICAST_HEADER_SIZE];
+    if (memcmp(h, "M65V", 4))
+      continue;
+    uint32_t sequence = (h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+
+    if (have_sequence) {
+      int32_t gap = sequence - expected;
+      if (gap < 0 && gap > -MULTICAST_RESTART_GAP && ++late_packets < MULTICAST_RESTART_PACKETS)
+        continue;
+      if (gap < 0) {
+        printf("Video stream has restarted at packet #%u.\n", sequence);
+        gap = 0;
+      }
+      if (gap > 0) {
+        multicast_lost += gap;
+        if (debug & 2)
+          printf("Lost %d packets before #%u (%lld total)\n", gap, sequence, multicast_lost);
+      }
+    }
+    expected = sequence + 1;
+    have_sequence = 1;
+    late_packets = 0;
+
+    if (!p) {
+      packets_dropped++;
+      continue;
+    }
+    p->len = VIDEO_PACKET_SIZE;
+    packet_queue_push();
+  }
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Replay of captured video packets
+   ----------------------------------------------------------------------------------------------------------
+
+   Captures can be either pcap files, e.g., from tcpdump or wireshark, in which case only the 2132
+   byte video frames are used, or raw files of back to back 2132 byte packets as sent by videoproxy.
+*/
+
+struct replay_file {
+  unsigned char *data;
+  size_t size;
+  size_t offset;
+  int is_pcap;
+  int swapped;
+  int nanoseconds;
+};
+
+uint32_t replay_u32(struct replay_file *r, size_t offset)
+{
+  uint32_t v;
+  memcpy(&v, &r->data[offset], 4);
+  return r->swapped ? __builtin_bswap32(v) : v;
+}
+
+int replay_open(struct replay_file *r, char *filename)
+{
+  bzero(r, sizeof(struct replay_file));
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || !st.st_size) {
+    fprintf(stderr, "Could not read '%s', or it is empty.\n", filename);
+    close(fd);
+    return -1;
+  }
+  r->size = st.st_size;
+  r->data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (r->data == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(r->data, r->size, MADV_SEQUENTIAL);
+
+  if (r->size >= 24) {
+    uint32_t magic;
+    memcpy(&magic, r->data, 4);
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+      r->is_pcap = 1;
+    else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+      r->is_pcap = r->swapped = 1;
+    if (r->is_pcap) {
+      r->nanoseconds = (replay_u32(r, 0) == 0xa1b23c4d);
+      r->offset = 24;
+    }
   }
   return 0;
 }
 
-int setRaster(rfbScreenInfoPtr screen, int y, uint32_t v)
+void replay_close(struct replay_file *r)
 {
-  if (y >= 0 && y < maxy) {
-    unsigned char *raster = &((unsigned char *)screen->frameBuffer)[y * maxx * 4];
-    raster[3] = 0;
-    raster[2] = v & 0xff;
-    raster[1] = (v >> 8) & 0xff;
-    raster[0] = (v >> 16) & 0xff;
-    bcopy(&raster[0], &raster[4], maxx * 4 - 1);
+  munmap(r->data, r->size);
+}
+
+// Returns the next video packet in the capture, or NULL at the end of the file.
+// *timestamp is set to the capture time in nanoseconds, or 0 for raw files.
+unsigned char *replay_next(struct replay_file *r, int *len, unsigned long long *timestamp)
+{
+  if (!r->is_pcap) {
+    if (r->offset + VIDEO_PACKET_SIZE > r->size)
+      return NULL;
+    unsigned char *p = &r->data[r->offset];
+    r->offset += VIDEO_PACKET_SIZE;
+    *len = VIDEO_PACKET_SIZE;
+    *timestamp = 0;
+    return p;
+  }
+
+  while (r->offset + 16 <= r->size) {
+    unsigned long long sec = replay_u32(r, r->offset);
+    unsigned long long frac = replay_u32(r, r->offset + 4);
+    uint32_t caplen = replay_u32(r, r->offset + 8);
+    unsigned char *p = &r->data[r->offset + 16];
+    if (r->offset + 16 + caplen > r->size)
+      return NULL;
+    r->offset += 16 + caplen;
+    if (caplen == VIDEO_PACKET_SIZE) {
+      *len = caplen;
+      *timestamp = sec * 1000000000ULL + (r->nanoseconds ? frac : frac * 1000);
+      return p;
+    }
+  }
+  return NULL;
+}
+
+unsigned long long replay_frames = 0;
+
+void countFrame(struct video_decoder *d)
+{
+  replay_frames++;
+}
+
+// Decode a capture as fast as possible, without serving it, and report the
+// decoder's speed.  The hash of the final frame allows decoder changes to be
+// checked for unintended differences in output.
+int replay_benchmark(char *filename)
+{
+  struct replay_file r;
+  if (replay_open(&r, filename))
+    return -1;
+
+  uint32_t *framebuffer = calloc(maxx * maxy, bpp);
+  if (!framebuffer) {
+    perror("calloc()");
+    return -1;
+  }
+  init_token_table();
+  struct video_decoder decoder;
+  decoder_init(&decoder, framebuffer, maxx, maxy);
+  decoder.new_frame = countFrame;
+
+  // Packets are copied so that the decoder's look-ahead never reads beyond
+  // the end of the mapped file
+  unsigned char packet[VIDEO_PACKET_SIZE + 8];
+  unsigned char *p;
+  int len;
+  unsigned long long timestamp;
+  unsigned long long packets = 0;
+
+  unsigned long long start = monotonic_ns();
+  while ((p = replay_next(&r, &len, &timestamp))) {
+    memcpy(packet, p, len);
+    decode_video_packet(&decoder, packet, len);
+    packets++;
   }
+  unsigned long long elapsed = monotonic_ns() - start;
+  if (!elapsed)
+    elapsed = 1;
+
+  uint32_t hash = 0x811c9dc5;
+  for (int i = 0; i < maxx * maxy; i++)
+    hash = (hash ^ framebuffer[i]) * 0x01000193;
+
+  printf("Decoded %lld packets, %lld frames, %lld pixels in %.3f seconds.\n", packets, replay_frames,
+      decoder.pixels, elapsed / 1000000000.0);
+  printf("%.1f frames/sec, %.2f ns/pixel, %.1f ns/packet.\n", replay_frames * 1000000000.0 / elapsed,
+      decoder.pixels ? (double)elapsed / decoder.pixels : 0.0, packets ? (double)elapsed / packets : 0.0);
+  printf("Final frame hash: %08x\n", hash);
+
+  free(framebuffer);
+  replay_close(&r);
   return 0;
 }
 
+char *replay_filename = NULL;
+
+// Feeds a capture into the decoder with its original timing, in place of
+// reading from videoproxy.  Raw captures have no timestamps, so are played at
+// the nominal 2132 byte packet rate of ~4,000 packets per second.
+void *replay_reader(void *arg)
+{
+  struct replay_file r;
+  if (replay_open(&r, replay_filename))
+    exit(-1);
+
+  unsigned char *p;
+  int len;
+  unsigned long long timestamp;
+  unsigned long long first_timestamp = 0;
+  unsigned long long start = monotonic_ns();
+  unsigned long long packets = 0;
+
+  while ((p = replay_next(&r, &len, &timestamp))) {
+    if (!timestamp)
+      timestamp = packets * 250000;
+    if (!packets)
+      first_timestamp = timestamp;
+    packets++;
+
+    long long wait = (long long)(timestamp - first_timestamp) - (long long)(monotonic_ns() - start);
+    if (wait > 0)
+      usleep(wait / 1000);
+
+    struct queued_packet *q = packet_queue_reserve();
+    if (!q) {
+      packets_dropped++;
+      continue;
+    }
+    memcpy(q->data, p, len);
+    q->len = len;
+    packet_queue_push();
+  }
+  fprintf(stderr, "End of replay: %lld packets, %lld dropped.\n", packets, packets_dropped);
+  replay_close(&r);
+  return NULL;
+}
+
 int dump_bytes(char *msg, unsigned char *bytes, int length)
 {
   fprintf(stdout, "%s:\n", msg);
@@ -650,10 +1608,71 @@ int dump_bytes(char *msg, unsigned char *bytes, int length)
   return 0;
 }
 
+void usage(void)
+{
+  fprintf(stderr, "usage: vncserver [--record <file>] [--multicast <group>[:port]] [serial port] [libvncserver options]\n");
+  fprintf(stderr, "       vncserver --replay <capture> [--realtime] [serial port] [libvncserver options]\n");
+  fprintf(stderr, "  --replay <capture>  decode a pcap or raw capture of video packets instead of\n");
+  fprintf(stderr, "                      connecting to videoproxy, and report the decoding speed.\n");
+  fprintf(stderr, "  --realtime          replay with the original timing, and serve it via VNC.\n");
+  fprintf(stderr, "  --record <file>     record the displayed frames to a file.  Use vncrec2png to view them.\n");
+  fprintf(stderr, "  --multicast <group>[:port]\n");
+  fprintf(stderr, "                      receive video from videoproxy -m instead of via TCP.\n");
+  exit(-3);
+}
+
+// Set on SIGINT or SIGTERM, so that the recording can be finished
+volatile sig_atomic_t quit = 0;
+
+void stop_running(int sig)
+{
+  quit = 1;
+}
+
 int main(int argc, char **argv)
 {
-  int do_dummy = 0;
-  int debug = 0; // x806; //0x21b;
+  int replay_realtime = 0;
+  char *record_filename = NULL;
+
+  // Take our own options out of argv, leaving the rest for libvncserver
+  int out = 1;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--replay")) {
+      if (i + 1 >= argc)
+        usage();
+      replay_filename = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--realtime"))
+      replay_realtime = 1;
+    else if (!strcmp(argv[i], "--multicast")) {
+      if (i + 1 >= argc)
+        usage();
+      multicast_spec = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--record")) {
+      if (i + 1 >= argc)
+        usage();
+      record_filename = argv[++i];
+    }
+    else if (!strcmp(argv[i], "--help"))
+      usage();
+    else
+      argv[out++] = argv[i];
+  }
+  argc = out;
+  argv[argc] = NULL;
+
+  if (replay_realtime && !replay_filename)
+    usage();
+  if (replay_filename && !replay_realtime)
+    return replay_benchmark(replay_filename) ? -1 : 0;
+
+  if (record_filename) {
+    if (record_open(record_filename))
+      exit(-1);
+    signal(SIGINT, stop_running);
+    signal(SIGTERM, stop_running);
+  }
 
   if (!do_dummy) {
     if (argc > 1)
@@ -664,15 +1683,20 @@ int main(int argc, char **argv)
   if (!rfbScreen)
     return 0;
   rfbScreen->desktopName = "MEGA65 Remote Display";
-  rfbScreen->frameBuffer = (char *)malloc(maxx * maxy * bpp);
+  display_buffer[0] = calloc(maxx * maxy, bpp);
+  display_buffer[1] = calloc(maxx * maxy, bpp);
+  uint32_t *decode_buffer = calloc(maxx * maxy, bpp);
+  if (!display_buffer[0] || !display_buffer[1] || !decode_buffer) {
+    perror("calloc()");
+    exit(-1);
+  }
+  rfbScreen->frameBuffer = (char *)display_buffer[display_front];
   rfbScreen->alwaysShared = TRUE;
   rfbScreen->kbdAddEvent = dokey;
   rfbScreen->newClientHook = newclient;
   rfbScreen->httpDir = "../webclients";
   rfbScreen->httpEnableProxyConnect = TRUE;
 
-  initBuffer((unsigned char *)rfbScreen->frameBuffer);
-
   /* initialize the server */
   rfbInitServer(rfbScreen);
 
@@ -680,9 +1704,10 @@ int main(int argc, char **argv)
   rfbRunEventLoop(rfbScreen, -1, TRUE);
   fprintf(stderr, "Running background loop...\n");
 
-  int sock = connect_to_port(6565);
-  if (!do_dummy) {
-    if (sock == -1) {
+  if (!replay_filename && !multicast_spec)
+    video_sock = connect_to_port(6565);
+  if (!do_dummy && !replay_filename && !multicast_spec) {
+    if (video_sock == -1) {
       fprintf(stderr, "Could not connect to video proxy on port 6565.\n");
       exit(-1);
     }
@@ -691,239 +1716,43 @@ int main(int argc, char **argv)
   printf("Started.\n");
   fflush(stdout);
 
-  int y = -1;
-  int x = 0;
-
-  char bit_sequence[21];
-
-  // Put end of string marker in place
-  bit_sequence[20] = 0;
-
-  while (1) {
-    unsigned char packet[8192];
-    int len;
-
-    if (do_dummy) {
-      // Feed dummy data (from simulation) to test
-      FILE *f = fopen("dummy.dat", "r");
-      if (f) {
-        char line[1024];
-        len = 0x56;
-        line[0] = 0;
-        fgets(line, 1024, f);
-        while (line[0] && (len < 8000)) {
-          packet[len++] = strtoll(line, NULL, 16);
-          line[0] = 0;
-          fgets(line, 1024, f);
-        }
-        fclose(f);
-      }
-    }
-    else {
-      len = read(sock, packet, 2132);
-      if (len < 1)
-        usleep(10000);
+  init_token_table();
+  struct video_decoder decoder;
+  decoder_init(&decoder, decode_buffer, maxx, maxy);
+  decoder.new_frame = newFrame;
+  decoder.context = rfbScreen;
+
+  if (replay_filename)
+    pthread_create(&readerThread, NULL, replay_reader, NULL);
+  else if (multicast_spec)
+    pthread_create(&readerThread, NULL, multicast_reader, NULL);
+  else
+    pthread_create(&readerThread, NULL, packet_reader, NULL);
+
+  // Decode on this thread, while the reader thread and libvncserver's event
+  // loop run in the background
+  while (!quit) {
+    struct queued_packet *p = packet_queue_peek();
+    if (!p) {
+      usleep(500);
+      continue;
     }
 
-    if (len > 2100) {
-      // probably a C65GS compressed video frame.
-      // printf("."); fflush(stdout);
-
-      if (debug & 2) {
-        printf("--------------- Packet.\n");
-        dump_bytes("packet", packet, len);
-      }
-
-      // Packet consists solely of bit-packed data
-
-      // Erase any banked up bits before starting decode of next packet
-      memset(bit_sequence, '.', 20);
-
-      // Start from beginning of data
-      int offset = 0x56;
-      int bn = 0;
-
-      int counter = 0;
-
-      // Process all bits in packet
-
-      // Start outside frame so that we can synchronise without visible artefacts
-      int lasty = -1;
-      y = -1;
-
-      for (; offset < len; offset++) {
-        if (debug & 0x200)
-          printf("> 0x%02x\n", packet[offset]);
-        for (bn = 7; bn >= 0; bn--) {
-          counter++;
-
-          int bit = (packet[offset] >> bn) & 1;
-          // Shuffle bits down
-          bcopy(&bit_sequence[1], &bit_sequence[0], 19);
-          bit_sequence[19] = '0' + bit;
-          if (debug & 0x200) {
-            if (bit_sequence[0] != '.')
-              printf(">> %-8d %s\n", counter, bit_sequence);
-          }
-
-          if (!strncmp("11110", bit_sequence, 5)) {
-            // Explcit colour (12 bits)
-            int s = bit_sequence[17];
-            bit_sequence[17] = 0;
-            int c = strtol(&bit_sequence[5], NULL, 2);
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = ((c & 0xf) << 4) | ((c & 0xf0) << 8) | ((c & 0xf00) << 12);
-            if (debug & 0x800)
-              printf("Saw new colour #%06x at (%d,%d)\n", colour0, x, y);
-            bit_sequence[17] = s;
-            memset(bit_sequence, '.', 17);
-            setPixel(rfbScreen, x++, y, colour0);
-          }
-          else if (!strncmp("111110", bit_sequence, 6)) {
-            // Indicate raster (10 bits)
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = strtol(&bit_sequence[6], NULL, 2);
-            if (lasty == -1) {
-              lasty = y;
-              y = -1;
-            }
-            else {
-              if ((y != (1 + lasty)) && (y != lasty)) {
-                // Non successive raster lines, block drawing
-                if (debug & 2)
-                  printf("lasty was %d, new y = %d\n", lasty, y);
-                lasty = y;
-                y = -1;
-              }
-              else
-                lasty = y;
-            }
-
-            bit_sequence[16] = s;
-            if (debug & 2)
-              printf("Raster #%d (MAX X value seen was %d)\n", y, x);
-            x = 0;
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            memset(bit_sequence, '.', 16);
-          }
-          else if (!strncmp("11111110", bit_sequence, 8)) {
-            // RLE run of 0 - 255 pixels
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            int r = strtol(&bit_sequence[8], NULL, 2);
-            bit_sequence[16] = s;
-            if (debug & 8)
-              printf("Run of %d at %d,%d\n", r, x, y);
-            if (x != -1)
-              for (; r && (x < 800); r--) {
-                setPixel(rfbScreen, x++, y, colour0);
-              }
-            memset(bit_sequence, '.', 16);
-            if (debug & 8)
-              printf("After run, x=%d\n", x);
-          }
-          else if (!strncmp("11111100", bit_sequence, 8)) {
-            // New frame
-            if (debug & 1)
-              printf("New frame (y got to %d)\n", y);
-            if (y != -1)
-              setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = -1;
-            x = -1;
-            memset(bit_sequence, '.', 8);
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            updateFrameBuffer(rfbScreen);
-          }
-          else if (!strncmp("11111101", bit_sequence, 8)) {
-            // Reserved -- this is an error for now
-            if (debug & 0x100)
-              printf("Reserved token.\n");
-            memset(bit_sequence, '.', 8);
-          }
-          else if (!strncmp("1100", bit_sequence, 4)) {
-            // Colour 2
-            int t = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 2 @ x=%d (colour=#%06x)\n", x, colour0);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1101", bit_sequence, 4)) {
-            // Colour 3
-            int t = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 3\n");
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1110", bit_sequence, 4)) {
-            // Colour 4
-            int t = colour4;
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 4 @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("10", bit_sequence, 2)) {
-            // Colour 1
-            int t = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Previous colour @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            //	    if (debug&4)
-            memset(bit_sequence, '.', 2);
-          }
-          else if (!strncmp("0", bit_sequence, 1)) {
-            // Repeat last colour
-            if (debug & 4)
-              printf("Same colour at %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 1);
-          }
-          //	  if (debug&0x800)
-          if (0)
-            printf("Colours = #%06x, #%06x, #%06x, #%06x, #%06x\n", colour0, colour1, colour2, colour3, colour4);
-        }
-      }
+    if (debug & 2) {
+      printf("--------------- Packet.\n");
+      dump_bytes("packet", p->data, p->len);
     }
+
+    decode_video_packet(&decoder, p->data, p->len);
+    packet_queue_pop();
   }
 
-  free(rfbScreen->frameBuffer);
+  if (record_filename)
+    record_close();
   rfbScreenCleanup(rfbScreen);
+  free(display_buffer[0]);
+  free(display_buffer[1]);
+  free(decode_buffer);
 
   return (0);
 }